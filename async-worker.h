@@ -1,65 +1,115 @@
 #pragma once
 
 #include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <map>
+#include <vector>
+#include <atomic>
 #include <string>
-#include <algorithm>
-#include <iterator>
 #include <thread>
 #include <deque>
-#include <map>
-#include <mutex>
-#include <chrono>
-#include <condition_variable>
 #include <nan.h>
-
-typedef std::map<std::string, std::string> MessageValues;
-
-struct Message {
-    std::string name;
+#include "message-queue.h"
+
+static inline unsigned option_uint(const v8::Local<v8::Object>& options, const char* const name, const unsigned def) {
+    if (!options->IsObject()) return def;
+    const v8::Local<v8::Value> value = Nan::Get(options, Nan::New<v8::String>(name).ToLocalChecked()).ToLocalChecked();
+    return value->IsUndefined() ? def : Nan::To<uint32_t>(value).FromJust();
+}
+
+static inline int option_int(const v8::Local<v8::Object>& options, const char* const name, const int def) {
+    if (!options->IsObject()) return def;
+    const v8::Local<v8::Value> value = Nan::Get(options, Nan::New<v8::String>(name).ToLocalChecked()).ToLocalChecked();
+    return value->IsUndefined() ? def : Nan::To<int32_t>(value).FromJust();
+}
+
+static inline std::string option_string(const v8::Local<v8::Object>& options, const char* const name, const std::string& def) {
+    if (!options->IsObject()) return def;
+    const v8::Local<v8::Value> value = Nan::Get(options, Nan::New<v8::String>(name).ToLocalChecked()).ToLocalChecked();
+    return value->IsUndefined() ? def : std::string(*Nan::Utf8String(value));
+}
+
+static inline bool option_bool(const v8::Local<v8::Object>& options, const char* const name, const bool def) {
+    if (!options->IsObject()) return def;
+    const v8::Local<v8::Value> value = Nan::Get(options, Nan::New<v8::String>(name).ToLocalChecked()).ToLocalChecked();
+    return value->IsUndefined() ? def : Nan::To<bool>(value).FromJust();
+}
+
+// all options as strings (the same way native front-ends get them from command line), so that
+// options shared with them are mapped in one place
+static inline MessageValues option_values(const v8::Local<v8::Object>& options) {
     MessageValues values;
-    Message(std::string name, MessageValues values) : name(name), values(values) {}
-};
-
-template<typename T> class MessageQueue {
+    if (!options->IsObject()) return values;
+    const v8::Local<v8::Array> names = Nan::GetOwnPropertyNames(options).ToLocalChecked();
+    for (uint32_t i = 0; i != names->Length(); ++i) {
+        const v8::Local<v8::Value> name = Nan::Get(names, i).ToLocalChecked();
+        values[*Nan::Utf8String(name)] = *Nan::Utf8String(Nan::Get(options, name).ToLocalChecked());
+    }
+    return values;
+}
+
+// runs worker Execute on its own native thread instead of a libuv threadpool one
+// (so it does not starve fs/dns/zlib work), completion is still handled on the event loop
+static inline void NativeQueueWorker(Nan::AsyncWorker* const worker) {
+    uv_async_t* const complete = new uv_async_t;
+    complete->data = worker;
+    uv_async_init(Nan::GetCurrentEventLoop(), complete, [](uv_async_t* const handle) {
+        Nan::AsyncWorker* const worker = static_cast<Nan::AsyncWorker*>(handle->data);
+        worker->WorkComplete();
+        worker->Destroy();
+        uv_close(reinterpret_cast<uv_handle_t*>(handle), [](uv_handle_t* const handle) {
+            delete reinterpret_cast<uv_async_t*>(handle);
+        });
+    });
+    std::thread([worker, complete]() {
+        worker->Execute();
+        uv_async_send(complete);
+    }).detach();
+}
+
+// percentiles of last samples of one result delivery stage (used from event loop thread only)
+class LatencyWindow {
 
     private:
 
-        std::mutex              m_mutex;
-        std::condition_variable m_cond;
-        std::deque<T>           m_buff;
+        static const size_t m_size = 1024;
 
-    public:
+        std::vector<double> m_samples; // microseconds
+        size_t              m_next;
+        uint64_t            m_count;
 
-        void write(T data) {
-            while (true) {
-                std::unique_lock<std::mutex> locker(m_mutex);
-                m_buff.push_back(data);
-                locker.unlock();
-                m_cond.notify_all();
-                return;
-            }
+        static void setNumber(v8::Local<v8::Object>& values, const char* const name, const double value) {
+            values->Set(Nan::New<v8::String>(name).ToLocalChecked(), Nan::New<v8::Number>(value));
         }
 
-        T read() {
-            while (true)
-            {
-                std::unique_lock<std::mutex> locker(m_mutex);
-                m_cond.wait(locker, [this]() {
-                    return m_buff.size() > 0;
-                });
-                T back = m_buff.front();
-                m_buff.pop_front();
-                locker.unlock();
-                m_cond.notify_all();
-                return back;
-            }
+    public:
+
+        LatencyWindow() : m_next(0), m_count(0) {}
+
+        void add(const int64_t from_ns, const int64_t to_ns) {
+            const double sample = (to_ns - from_ns) / 1000.0;
+            if (m_samples.size() < m_size) m_samples.push_back(sample);
+            else m_samples[m_next] = sample;
+            m_next = (m_next + 1) % m_size;
+            ++ m_count;
         }
 
-        void readAll(std::deque<T>& target) {
-            std::unique_lock<std::mutex> locker(m_mutex);
-            std::copy(m_buff.begin(), m_buff.end(), std::back_inserter(target));
-            m_buff.clear();
-            locker.unlock();
+        // {count, p50, p90, p99, max} in microseconds over last samples
+        v8::Local<v8::Object> stats() const {
+            Nan::EscapableHandleScope scope;
+            v8::Local<v8::Object> values = Nan::New<v8::Object>();
+            setNumber(values, "count", static_cast<double>(m_count));
+            if (!m_samples.empty()) {
+                std::vector<double> samples(m_samples);
+                std::sort(samples.begin(), samples.end());
+                setNumber(values, "p50", samples[(samples.size() - 1) * 50 / 100]);
+                setNumber(values, "p90", samples[(samples.size() - 1) * 90 / 100]);
+                setNumber(values, "p99", samples[(samples.size() - 1) * 99 / 100]);
+                setNumber(values, "max", samples.back());
+            }
+            return scope.Escape(values);
         }
 };
 
@@ -70,9 +120,105 @@ class AsyncWorker: public Nan::AsyncProgressQueueWorker<char> {
         Nan::Callback* const  m_progress;
         Nan::Callback* const  m_error_callback;
         MessageQueue<Message> m_toNode;
+        MessageQueue<Result>  m_toNodeResults;
+        const bool            m_batch_results;
+        const size_t          m_queue_limit;         // queued messages or results over it are counted
+        std::atomic<bool>     m_signalled;           // progress was sent but queues are not drained yet
+        std::atomic<uint64_t> m_results_overflow;    // results queued while there were queue_limit of them
+        std::atomic<uint64_t> m_messages_overflow;   // messages queued while there were queue_limit of them
+        std::atomic<uint64_t> m_hashrates_coalesced; // hashrate updates replaced by newer ones before delivery
+        LatencyWindow         m_found_to_queued;     // hashing thread to to-Node queue
+        LatencyWindow         m_queued_to_delivered; // to-Node queue to JS progress callback (event loop lag)
+        LatencyWindow         m_found_to_delivered;
+
+        static void setValue(v8::Local<v8::Object>& values, const char* const name, const char* const value) {
+            values->Set(Nan::New<v8::String>(name).ToLocalChecked(), Nan::New<v8::String>(value).ToLocalChecked());
+        }
+
+        static std::string value(const Message& msg, const char* const name) {
+            const MessageValues::const_iterator pi = msg.values.find(name);
+            return pi == msg.values.end() ? "" : pi->second;
+        }
+
+        // delivers all pending results with one ("results", {count, record_size, records, jobs}) call, where
+        // records Buffer has count records of record_size bytes each (little endian):
+        //   0: uint64 nonce, 8: 32 bytes hash, 40: uint16 thread, 42: uint8 way, 43: reserved,
+        //   44: uint32 index of job id in jobs array
+        void drainResultsBatch(const std::deque<Result>& results) {
+            const unsigned record_size = 48;
+            v8::Local<v8::Object> records = Nan::NewBuffer(results.size() * record_size).ToLocalChecked();
+            uint8_t* record = reinterpret_cast<uint8_t*>(node::Buffer::Data(records));
+            v8::Local<v8::Array> jobs = Nan::New<v8::Array>();
+            std::map<std::string, uint32_t> job2index;
+            for (const Result& result : results) {
+                std::map<std::string, uint32_t>::const_iterator pi = job2index.find(result.job_id);
+                if (pi == job2index.end()) {
+                    pi = job2index.insert(std::make_pair(std::string(result.job_id), job2index.size())).first;
+                    jobs->Set(pi->second, Nan::New<v8::String>(result.job_id).ToLocalChecked());
+                }
+                put_le(record, result.nonce, 8);
+                memcpy(record + 8, result.hash, hash_len);
+                put_le(record + 40, result.thread, 2);
+                record[42] = result.way;
+                record[43] = 0;
+                put_le(record + 44, pi->second, 4);
+                record += record_size;
+            }
+            v8::Local<v8::Object> values = Nan::New<v8::Object>();
+            values->Set(Nan::New<v8::String>("count").ToLocalChecked(), Nan::New<v8::Number>(results.size()));
+            values->Set(Nan::New<v8::String>("record_size").ToLocalChecked(), Nan::New<v8::Number>(record_size));
+            values->Set(Nan::New<v8::String>("records").ToLocalChecked(), records);
+            values->Set(Nan::New<v8::String>("jobs").ToLocalChecked(), jobs);
+            v8::Local<v8::Value> argv[] = {
+                Nan::New<v8::String>("results").ToLocalChecked(),
+                values
+            };
+            const int64_t delivered_ns = steady_ns();
+            for (const Result& result : results) delivered(result, delivered_ns);
+            m_progress->Call(2, argv, async_resource);
+        }
+
+        void delivered(const Result& result, const int64_t delivered_ns) {
+            m_found_to_queued.add(result.found_ns, result.queued_ns);
+            m_queued_to_delivered.add(result.queued_ns, delivered_ns);
+            m_found_to_delivered.add(result.found_ns, delivered_ns);
+        }
+
+        // delivers typed results as old string "result" messages (or as one batch if batch_results option is set)
+        void drainResults() {
+            std::deque<Result> results;
+            m_toNodeResults.readAll(results);
+
+            if (m_batch_results) {
+                if (!results.empty()) drainResultsBatch(results);
+                return;
+            }
+
+            for (const Result& result : results) {
+                char str[32];
+                v8::Local<v8::Object> values = Nan::New<v8::Object>();
+                snprintf(str, sizeof(str), "%llu", static_cast<unsigned long long>(result.nonce));
+                setValue(values, "nonce", str);
+                setValue(values, "hash", to_hex(result.hash, hash_len).c_str());
+                snprintf(str, sizeof(str), "%u", result.thread);
+                setValue(values, "thread", str);
+                snprintf(str, sizeof(str), "%u", result.way);
+                setValue(values, "way", str);
+                if (result.job_id[0]) setValue(values, "job_id", result.job_id);
+                v8::Local<v8::Value> argv[] = {
+                    Nan::New<v8::String>("result").ToLocalChecked(),
+                    values
+                };
+                delivered(result, steady_ns());
+                m_progress->Call(2, argv, async_resource);
+            }
+        }
 
         void drainQueue() {
             Nan::HandleScope scope;
+            m_signalled = false;
+            drainResults();
+
             std::deque<Message> contents;
             m_toNode.readAll(contents);
 
@@ -108,17 +254,42 @@ class AsyncWorker: public Nan::AsyncProgressQueueWorker<char> {
 
     protected:
 
+        // wakes up event loop only once per drain however many messages are queued meanwhile
+        void signal(const AsyncProgressQueueWorker<char>::ExecutionProgress& progress) {
+            if (!m_signalled.exchange(true)) progress.Send(reinterpret_cast<const char*>(&m_toNode), sizeof(m_toNode));
+        }
+
+        // periodic hashrate updates coalesce to the latest one per job, other messages (errors, range_end, shares
+        // and other events JS can not miss) are never dropped, but ones that find queue_limit messages queued are counted
         void sendToNode(const AsyncProgressQueueWorker<char>::ExecutionProgress& progress, const Message& msg) {
-            m_toNode.write(msg);
-            progress.Send(reinterpret_cast<const char*>(&m_toNode), sizeof(m_toNode));
+            if (msg.name == "hashrate") {
+                // jobs without id are told apart by their thread group
+                const std::string key = value(msg, "job_id") + "/" + value(msg, "group");
+                if (m_toNode.writeCoalesced(msg, [&key](const Message& queued) {
+                    return queued.name == "hashrate" && value(queued, "job_id") + "/" + value(queued, "group") == key;
+                })) ++ m_hashrates_coalesced;
+            } else if (m_toNode.write(msg) > m_queue_limit) {
+                ++ m_messages_overflow;
+            }
+            signal(progress);
+        }
+
+        // results are never dropped, but ones that find queue_limit results already queued are counted
+        void sendToNode(const AsyncProgressQueueWorker<char>::ExecutionProgress& progress, const Result& result) {
+            Result queued = result;
+            queued.queued_ns = steady_ns();
+            if (m_toNodeResults.write(queued) > m_queue_limit) ++ m_results_overflow;
+            signal(progress);
         }
   
     public:
 
         MessageQueue<Message> fromNode;
 
-        AsyncWorker(Nan::Callback* const progress, Nan::Callback* const callback, Nan::Callback* const error_callback)
-            : Nan::AsyncProgressQueueWorker<char>(callback, "sickle-core::AsyncWorker"), m_progress(progress), m_error_callback(error_callback)
+        AsyncWorker(Nan::Callback* const progress, Nan::Callback* const callback, Nan::Callback* const error_callback, const v8::Local<v8::Object>& options)
+            : Nan::AsyncProgressQueueWorker<char>(callback, "sickle-core::AsyncWorker"), m_progress(progress), m_error_callback(error_callback),
+              m_batch_results(option_bool(options, "batch_results", false)), m_queue_limit(option_uint(options, "queue_limit", 1024)),
+              m_signalled(false), m_results_overflow(0), m_messages_overflow(0), m_hashrates_coalesced(0)
             {
             }
       
@@ -126,6 +297,26 @@ class AsyncWorker: public Nan::AsyncProgressQueueWorker<char> {
             delete m_progress;
             delete m_error_callback;
         }
+
+        // queue depths, high water marks, backpressure counters and result latency percentiles,
+        // so event loop stalls can be told apart from hashing itself
+        v8::Local<v8::Object> stats() {
+            Nan::EscapableHandleScope scope;
+            v8::Local<v8::Object> values = Nan::New<v8::Object>();
+            values->Set(Nan::New<v8::String>("messages_depth").ToLocalChecked(),      Nan::New<v8::Number>(m_toNode.size()));
+            values->Set(Nan::New<v8::String>("messages_high_water").ToLocalChecked(), Nan::New<v8::Number>(m_toNode.highWater()));
+            values->Set(Nan::New<v8::String>("messages_overflow").ToLocalChecked(),   Nan::New<v8::Number>(static_cast<double>(m_messages_overflow.load())));
+            values->Set(Nan::New<v8::String>("hashrates_coalesced").ToLocalChecked(), Nan::New<v8::Number>(static_cast<double>(m_hashrates_coalesced.load())));
+            values->Set(Nan::New<v8::String>("results_depth").ToLocalChecked(),       Nan::New<v8::Number>(m_toNodeResults.size()));
+            values->Set(Nan::New<v8::String>("results_high_water").ToLocalChecked(),  Nan::New<v8::Number>(m_toNodeResults.highWater()));
+            values->Set(Nan::New<v8::String>("results_overflow").ToLocalChecked(),    Nan::New<v8::Number>(static_cast<double>(m_results_overflow.load())));
+            v8::Local<v8::Object> latency = Nan::New<v8::Object>();
+            latency->Set(Nan::New<v8::String>("found_to_queued").ToLocalChecked(),     m_found_to_queued.stats());
+            latency->Set(Nan::New<v8::String>("queued_to_delivered").ToLocalChecked(), m_queued_to_delivered.stats());
+            latency->Set(Nan::New<v8::String>("found_to_delivered").ToLocalChecked(),  m_found_to_delivered.stats());
+            values->Set(Nan::New<v8::String>("latency_us").ToLocalChecked(), latency);
+            return scope.Escape(values);
+        }
       
 };
 
@@ -153,11 +344,12 @@ class AsyncWorkerWrapper: public Nan::ObjectWrap {
                 info.GetReturnValue().Set(info.This());
 
                 // start the worker
-                AsyncQueueWorker(obj->m_worker);
+                if (option_bool(options, "native_thread", false)) NativeQueueWorker(obj->m_worker);
+                else AsyncQueueWorker(obj->m_worker);
 
             } else {
-                const int argc = 3;
-                v8::Local<v8::Value> argv[argc] = { info[0], info[1], info[2] };
+                const int argc = 4;
+                v8::Local<v8::Value> argv[argc] = { info[0], info[1], info[2], info[3] };
                 v8::Local<v8::Function> cons   = Nan::New(constructor());
                 v8::Local<v8::Object> instance = Nan::NewInstance(cons, argc, argv).ToLocalChecked();
                 info.GetReturnValue().Set(instance);
@@ -178,6 +370,85 @@ class AsyncWorkerWrapper: public Nan::ObjectWrap {
             Nan::ObjectWrap::Unwrap<AsyncWorkerWrapper>(info.Holder())->m_worker->fromNode.write(Message(*name, values));
         }
 
+        // exact non-negative integer: a Number up to 2^53 or a lossless BigInt (for larger values),
+        // otherwise throws naming the field and returns false
+        static bool uint64_value(const v8::Local<v8::Value>& value, const char* const name, uint64_t& result) {
+#if NODE_MAJOR_VERSION >= 10
+            if (value->IsBigInt()) {
+                bool lossless = false;
+                result = value.As<v8::BigInt>()->Uint64Value(&lossless);
+                if (lossless) return true;
+                Nan::ThrowRangeError((std::string("Job ") + name + " BigInt should be within 0..2^64-1").c_str());
+                return false;
+            }
+#endif
+            if (!value->IsNumber()) {
+                Nan::ThrowTypeError((std::string("Job ") + name + " should be Number or BigInt").c_str());
+                return false;
+            }
+            const double max_safe_integer = 9007199254740992.0; // 2^53
+            const double number = Nan::To<double>(value).FromJust();
+            if (!std::isfinite(number) || number < 0 || number != std::floor(number) || number > max_safe_integer) {
+                Nan::ThrowRangeError((std::string("Job ") + name + " should be integer within 0..2^53 (use BigInt for larger values)").c_str());
+                return false;
+            }
+            result = static_cast<uint64_t>(number);
+            return true;
+        }
+
+        // job with blob as Buffer/Uint8Array and 64-bit target (and optional local_target and nonce range
+        // fields) as Number or BigInt, so it needs no hex round trip
+        static NAN_METHOD(sendJob) {
+            if (!info[0]->IsObject()) return Nan::ThrowTypeError("Job object expected");
+            const v8::Local<v8::Object> obj = info[0].As<v8::Object>();
+            std::shared_ptr<JobRequest> job(new JobRequest());
+
+            job->algo     = option_string(obj, "algo", "");
+            job->soft_aes = option_bool(obj, "soft_aes", false);
+            job->ways     = option_string(obj, "ways", "1") == "auto" ? 0 : option_uint(obj, "ways", 1);
+            job->job_id   = option_string(obj, "job_id", "");
+            job->threads  = option_string(obj, "threads", "");
+            if (!job->setNonceLayout(option_int(obj, "nonce_offset", job->nonce_offset), option_int(obj, "nonce_width", job->nonce_width))) {
+                return Nan::ThrowRangeError("Job nonce_offset should be inside blob and nonce_width should be 4 or 8");
+            }
+
+            const v8::Local<v8::Value> blob = Nan::Get(obj, Nan::New<v8::String>("blob").ToLocalChecked()).ToLocalChecked();
+            if (!blob->IsArrayBufferView()) return Nan::ThrowTypeError("Job blob should be Buffer or Uint8Array");
+            const v8::Local<v8::ArrayBufferView> blob_view = blob.As<v8::ArrayBufferView>();
+            if (blob_view->ByteLength() > max_blob_len) return Nan::ThrowRangeError("Job blob is too long");
+            uint8_t blob_data[max_blob_len];
+            job->setBlob(blob_data, blob_view->CopyContents(blob_data, max_blob_len));
+
+            // target can also be 32 bytes little endian 256-bit one or be replaced by exact difficulty
+            const v8::Local<v8::Value> target = Nan::Get(obj, Nan::New<v8::String>("target").ToLocalChecked()).ToLocalChecked();
+            const v8::Local<v8::Value> difficulty = Nan::Get(obj, Nan::New<v8::String>("difficulty").ToLocalChecked()).ToLocalChecked();
+            if (!difficulty->IsUndefined()) {
+                if (!uint64_value(difficulty, "difficulty", job->difficulty)) return;
+            } else if (target->IsArrayBufferView()) {
+                const v8::Local<v8::ArrayBufferView> target_view = target.As<v8::ArrayBufferView>();
+                if (target_view->ByteLength() != hash_len) return Nan::ThrowRangeError("Job target Buffer should be 32 bytes");
+                uint8_t target256[hash_len];
+                target_view->CopyContents(target256, hash_len);
+                job->setTarget256(target256);
+            } else if (!uint64_value(target, "target", job->target)) {
+                return;
+            }
+            const v8::Local<v8::Value> local_target = Nan::Get(obj, Nan::New<v8::String>("local_target").ToLocalChecked()).ToLocalChecked();
+            if (!local_target->IsUndefined() && !uint64_value(local_target, "local_target", job->local_target)) return;
+            static const char* const nonce_names[] = { "nonce_start", "nonce_end", "nonce_stride", "nonce_partition" };
+            uint64_t* const nonce_values[] = { &job->nonce_start, &job->nonce_end, &job->nonce_stride, &job->nonce_partition };
+            for (unsigned i = 0; i != 4; ++i) {
+                const v8::Local<v8::Value> value = Nan::Get(obj, Nan::New<v8::String>(nonce_names[i]).ToLocalChecked()).ToLocalChecked();
+                if (!value->IsUndefined() && !uint64_value(value, nonce_names[i], *nonce_values[i])) return;
+            }
+
+            Nan::ObjectWrap::Unwrap<AsyncWorkerWrapper>(info.Holder())->m_worker->fromNode.write(Message("job", MessageValues(), job));
+        }
+
+        static NAN_METHOD(stats) {
+            info.GetReturnValue().Set(Nan::ObjectWrap::Unwrap<AsyncWorkerWrapper>(info.Holder())->m_worker->stats());
+        }
+
         static inline Nan::Persistent<v8::Function>& constructor() {
             static Nan::Persistent<v8::Function> my_constructor;
             return my_constructor;
@@ -191,6 +462,8 @@ class AsyncWorkerWrapper: public Nan::ObjectWrap {
             tpl->InstanceTemplate()->SetInternalFieldCount(2);
 
             SetPrototypeMethod(tpl, "sendToCpp", sendToCpp);
+            SetPrototypeMethod(tpl, "sendJob", sendJob);
+            SetPrototypeMethod(tpl, "stats", stats);
     
             constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
             Nan::Set(target, Nan::New("AsyncWorker").ToLocalChecked(),
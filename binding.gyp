@@ -24,5 +24,68 @@
                 "-std=gnu++11 -fPIC -DNDEBUG -Ofast -s -funroll-loops -fvariable-expansion-in-unroller -ftree-loop-if-convert-stores -fmerge-all-constants -fbranch-target-load-optimize2"
             ]
         }
+    ],
+    "conditions": [
+        # native front-ends use POSIX shared memory and Unix sockets
+        ["OS=='linux'", {
+            "targets": [
+                {
+                    "target_name": "sickle-shm",
+                    "type": "executable",
+                    "sources": [
+                        "sickle-shm.cpp",
+                        "xmrig/crypto/c_blake256.c",
+                        "xmrig/crypto/c_groestl.c",
+                        "xmrig/crypto/c_jh.c",
+                        "xmrig/crypto/c_skein.c",
+                        "xmrig/common/crypto/keccak.cpp"
+                    ],
+                    "include_dirs": [
+                        "xmrig",
+                        "xmrig/3rdparty"
+                    ],
+                    "libraries": [
+                        "-lpthread",
+                        "-lrt"
+                    ],
+                    "cflags_c": [
+                        '<!@(uname -a | grep "aarch64" >/dev/null && echo "-march=armv8-a+crypto" || (uname -a | grep "armv7" >/dev/null && echo "-mfpu=neon -flax-vector-conversions" || echo "-march=native"))',
+                        "-std=gnu11 -w -fPIC -DNDEBUG -Ofast -funroll-loops -fvariable-expansion-in-unroller -ftree-loop-if-convert-stores -fmerge-all-constants -fbranch-target-load-optimize2"
+                    ],
+                    "cflags_cc": [
+                        '<!@(uname -a | grep "aarch64" >/dev/null && echo "-march=armv8-a+crypto -flax-vector-conversions" || (uname -a | grep "armv7" >/dev/null && echo "-mfpu=neon -flax-vector-conversions" || echo "-march=native"))',
+                        "-std=gnu++11 -fPIC -DNDEBUG -Ofast -s -funroll-loops -fvariable-expansion-in-unroller -ftree-loop-if-convert-stores -fmerge-all-constants -fbranch-target-load-optimize2"
+                    ]
+                },
+                {
+                    "target_name": "sickle-daemon",
+                    "type": "executable",
+                    "sources": [
+                        "sickle-daemon.cpp",
+                        "xmrig/crypto/c_blake256.c",
+                        "xmrig/crypto/c_groestl.c",
+                        "xmrig/crypto/c_jh.c",
+                        "xmrig/crypto/c_skein.c",
+                        "xmrig/common/crypto/keccak.cpp"
+                    ],
+                    "include_dirs": [
+                        "xmrig",
+                        "xmrig/3rdparty"
+                    ],
+                    "libraries": [
+                        "-lpthread",
+                        "-lrt"
+                    ],
+                    "cflags_c": [
+                        '<!@(uname -a | grep "aarch64" >/dev/null && echo "-march=armv8-a+crypto" || (uname -a | grep "armv7" >/dev/null && echo "-mfpu=neon -flax-vector-conversions" || echo "-march=native"))',
+                        "-std=gnu11 -w -fPIC -DNDEBUG -Ofast -funroll-loops -fvariable-expansion-in-unroller -ftree-loop-if-convert-stores -fmerge-all-constants -fbranch-target-load-optimize2"
+                    ],
+                    "cflags_cc": [
+                        '<!@(uname -a | grep "aarch64" >/dev/null && echo "-march=armv8-a+crypto -flax-vector-conversions" || (uname -a | grep "armv7" >/dev/null && echo "-mfpu=neon -flax-vector-conversions" || echo "-march=native"))',
+                        "-std=gnu++11 -fPIC -DNDEBUG -Ofast -s -funroll-loops -fvariable-expansion-in-unroller -ftree-loop-if-convert-stores -fmerge-all-constants -fbranch-target-load-optimize2"
+                    ]
+                }
+            ]
+        }]
     ]
 }
@@ -0,0 +1,1056 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "message-queue.h"
+#include "platform.h"
+
+#if defined(__ARM_ARCH)
+#define XMRIG_ARM 1
+#include "xmrig/crypto/CryptoNight_arm.h"
+#else
+#include "xmrig/crypto/CryptoNight_x86.h"
+#endif
+
+#if (defined(__AES__) && (__AES__ == 1)) || (defined(__ARM_FEATURE_CRYPTO) && (__ARM_FEATURE_CRYPTO == 1))
+#define SOFT_AES false
+#else
+#warning Using software AES
+#define SOFT_AES true
+#endif
+
+const unsigned max_ways = 5;
+
+typedef void (*cn_hash_fun)(const uint8_t *blob, size_t size, uint8_t *output, cryptonight_ctx **ctx);
+
+#define MAP_ALGO2FN(hash, soft_aes) {\
+        { "cn",                     cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_1> },\
+        { "cryptonight",            cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_1> },\
+        { "cn/0",                   cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_0> },\
+        { "cryptonight/0",          cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_0> },\
+        { "cn/1",                   cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_1> },\
+        { "cryptonight/1",          cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_1> },\
+        { "cn/xtl",                 cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_XTL> },\
+        { "cryptonight/xtl",        cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_XTL> },\
+        { "cn/msr",                 cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_MSR> },\
+        { "cryptonight/msr",        cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_MSR> },\
+        { "cn/xao",                 cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_XAO> },\
+        { "cryptonight/xao",        cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_XAO> },\
+        { "cn/rto",                 cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_RTO> },\
+        { "cryptonight/rto",        cryptonight_##hash##_hash<xmrig::CRYPTONIGHT,       soft_aes, xmrig::VARIANT_RTO> },\
+        { "cn-lite",                cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_LITE,  soft_aes, xmrig::VARIANT_1> },\
+        { "cryptonight-lite",       cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_LITE,  soft_aes, xmrig::VARIANT_1> },\
+        { "cn-lite/0",              cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_LITE,  soft_aes, xmrig::VARIANT_0> },\
+        { "cryptonight-lite/0",     cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_LITE,  soft_aes, xmrig::VARIANT_0> },\
+        { "cn-lite/1",              cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_LITE,  soft_aes, xmrig::VARIANT_1> },\
+        { "cryptonight-lite/1",     cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_LITE,  soft_aes, xmrig::VARIANT_1> },\
+        { "cn-heavy",               cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_HEAVY, soft_aes, xmrig::VARIANT_0> },\
+        { "cryptonight-heavy",      cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_HEAVY, soft_aes, xmrig::VARIANT_0> },\
+        { "cn-heavy/0",             cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_HEAVY, soft_aes, xmrig::VARIANT_0> },\
+        { "cryptonight-heavy/0",    cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_HEAVY, soft_aes, xmrig::VARIANT_0> },\
+        { "cn-heavy/xhv",           cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_HEAVY, soft_aes, xmrig::VARIANT_XHV> },\
+        { "cryptonight-heavy/xhv",  cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_HEAVY, soft_aes, xmrig::VARIANT_XHV> },\
+        { "cn-heavy/tube",          cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_HEAVY, soft_aes, xmrig::VARIANT_TUBE> },\
+        { "cryptonight-heavy/tube", cryptonight_##hash##_hash<xmrig::CRYPTONIGHT_HEAVY, soft_aes, xmrig::VARIANT_TUBE> }\
+    }
+
+const std::map<std::string, cn_hash_fun> algo2fn[max_ways][2] = {
+    { MAP_ALGO2FN(single, 0), MAP_ALGO2FN(single, 1) },
+    { MAP_ALGO2FN(double, 0), MAP_ALGO2FN(double, 1) },
+    { MAP_ALGO2FN(triple, 0), MAP_ALGO2FN(triple, 1) },
+    { MAP_ALGO2FN(quad,   0), MAP_ALGO2FN(quad,   1) },
+    { MAP_ALGO2FN(penta,  0), MAP_ALGO2FN(penta,  1) }
+};
+
+const std::map<std::string, unsigned> algo2mem = {
+        { "cn",                     xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cryptonight",            xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cn/0",                   xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cryptonight/0",          xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cn/1",                   xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cryptonight/1",          xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cn/xtl",                 xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cryptonight/xtl",        xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cn/msr",                 xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cryptonight/msr",        xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cn/xao",                 xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cryptonight/xao",        xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cn/rto",                 xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cryptonight/rto",        xmrig::CRYPTONIGHT_MEMORY }, 
+        { "cn-lite",                xmrig::CRYPTONIGHT_LITE_MEMORY }, 
+        { "cryptonight-lite",       xmrig::CRYPTONIGHT_LITE_MEMORY }, 
+        { "cn-lite/0",              xmrig::CRYPTONIGHT_LITE_MEMORY }, 
+        { "cryptonight-lite/0",     xmrig::CRYPTONIGHT_LITE_MEMORY }, 
+        { "cn-lite/1",              xmrig::CRYPTONIGHT_LITE_MEMORY }, 
+        { "cryptonight-lite/1",     xmrig::CRYPTONIGHT_LITE_MEMORY }, 
+        { "cn-heavy",               xmrig::CRYPTONIGHT_HEAVY_MEMORY }, 
+        { "cryptonight-heavy",      xmrig::CRYPTONIGHT_HEAVY_MEMORY }, 
+        { "cn-heavy/0",             xmrig::CRYPTONIGHT_HEAVY_MEMORY }, 
+        { "cryptonight-heavy/0",    xmrig::CRYPTONIGHT_HEAVY_MEMORY }, 
+        { "cn-heavy/xhv",           xmrig::CRYPTONIGHT_HEAVY_MEMORY }, 
+        { "cryptonight-heavy/xhv",  xmrig::CRYPTONIGHT_HEAVY_MEMORY }, 
+        { "cn-heavy/tube",          xmrig::CRYPTONIGHT_HEAVY_MEMORY }, 
+        { "cryptonight-heavy/tube", xmrig::CRYPTONIGHT_HEAVY_MEMORY }
+};
+
+// nonce of the way at any blob offset (so it may be unaligned)
+template<typename Nonce> static inline Nonce get_nonce(const uint8_t* const blob, const unsigned blob_len, const unsigned offset, const unsigned way) {
+    Nonce nonce;
+    memcpy(&nonce, blob + (way * blob_len) + offset, sizeof(nonce));
+    return nonce;
+}
+
+template<typename Nonce> static inline void set_nonce(uint8_t* const blob, const unsigned blob_len, const unsigned offset, const unsigned way, const Nonce nonce) {
+    memcpy(blob + (way * blob_len) + offset, &nonce, sizeof(nonce));
+}
+
+inline static uint64_t *p_result(uint8_t* const hash, const unsigned way) {
+    return reinterpret_cast<uint64_t*>(hash + (way * hash_len) + 24);
+}
+
+// hashes and 256-bit targets are little endian numbers
+static inline bool hash_not_above(const uint8_t* const hash, const uint8_t* const target) {
+    for (int i = hash_len - 1; i >= 0; --i) if (hash[i] != target[i]) return hash[i] < target[i];
+    return true;
+}
+
+// exact (2^256 - 1) / difficulty by long division, so that hash <= target is the same as
+// hash * difficulty < 2^256 check pools and daemons do
+static inline void difficulty_target(const uint64_t difficulty, uint8_t* const target) {
+    uint64_t remainder = 0;
+    memset(target, 0, hash_len);
+    for (int bit = hash_len * 8 - 1; bit >= 0; --bit) {
+        const bool carry = remainder >> 63;
+        remainder = remainder << 1 | 1; // every dividend bit is 1
+        if (carry || remainder >= difficulty) {
+            remainder -= difficulty;
+            target[bit >> 3] |= 1 << (bit & 7);
+        }
+    }
+}
+
+static inline unsigned char hf_hex2bin(const char c, bool& err) {
+    if (c >= '0' && c <= '9')      return c - '0';
+    else if (c >= 'a' && c <= 'f') return c - 'a' + 0xA;
+    else if (c >= 'A' && c <= 'F') return c - 'A' + 0xA;
+    err = true;
+    return 0;
+}
+
+static bool fromHex(const char* in, unsigned int len, unsigned char* out) {
+    bool error = false;
+    for (unsigned int i = 0; i < len; ++i, ++out, in += 2) {
+        *out = (hf_hex2bin(*in, error) << 4) | hf_hex2bin(*(in + 1), error);
+        if (error) return false;
+    }
+    return true;
+}
+
+// job decoded once by the engine and given to a group of its hashing threads (fn == nullptr means paused),
+// every thread of the group gets own [nonce_first, nonce_last) part of indexes of job nonces
+struct Job {
+    cn_hash_fun fn;
+    unsigned    ways;
+    unsigned    mem;
+    unsigned    blob_len;
+    uint8_t     blob[max_blob_len];
+    uint64_t    target_max;   // hashes which top 64 bits are not above it are results (or candidates with full_target)
+    bool        full_target;  // candidates are checked against the whole target256
+    uint8_t     target256[hash_len];
+    uint64_t    local_target; // hashes below it are counted as local hits (0 to disable)
+    char        id[max_job_id_len + 1];
+    unsigned    nonce_offset;
+    unsigned    nonce_width;  // sizeof(uint32_t) or sizeof(uint64_t)
+    uint64_t    nonce_base;   // nonce with index 0
+    uint64_t    nonce_stride; // distance between nonces with adjacent indexes
+    uint64_t    nonce_first;
+    uint64_t    nonce_last;
+    std::shared_ptr<std::atomic<unsigned>> ranges_left; // threads of the group that did not hash all their nonces yet
+    Job() : fn(nullptr), ways(0), mem(0), blob_len(0), target_max(0), full_target(false), target256(), local_target(0), id(), nonce_offset(39), nonce_width(sizeof(uint32_t)),
+            nonce_base(0), nonce_stride(1), nonce_first(0), nonce_last(1ULL << 32) {}
+
+    uint64_t nonce(const uint64_t index) const {
+        return nonce_base + index * nonce_stride;
+    }
+
+    // true if job hashes the same nonces of the same blob as other one (target and id may differ),
+    // so nonces other one already hashed do not need to be hashed again
+    bool sameWork(const Job& other) const {
+        return fn && fn == other.fn && ways == other.ways && blob_len == other.blob_len && !memcmp(blob, other.blob, blob_len) &&
+               nonce_offset == other.nonce_offset && nonce_width == other.nonce_width && nonce_base == other.nonce_base &&
+               nonce_stride == other.nonce_stride && nonce_first == other.nonce_first && nonce_last == other.nonce_last;
+    }
+
+    // for cold paths, hot loop is specialized by nonce width instead
+    void setNonce(uint8_t* const blob, const unsigned way, const uint64_t nonce) const {
+        if (nonce_width == sizeof(uint64_t)) set_nonce<uint64_t>(blob, blob_len, nonce_offset, way, nonce);
+        else set_nonce<uint32_t>(blob, blob_len, nonce_offset, way, static_cast<uint32_t>(nonce));
+    }
+};
+
+// memory left for the rest of the process when scratchpads are sized automatically
+const uint64_t auto_mem_reserve = 128ULL << 20;
+
+// replaced jobs every thread keeps nonce progress of and jobs engine can resume by id
+const size_t max_resumable_jobs = 8;
+
+struct EngineOptions {
+    unsigned threads;  // 0 means pick by available (cgroup limited) cpus and memory
+    bool     affinity;    // pin threads to cpus so that their scratchpads fit into L3 caches
+    unsigned idle_target; // park threads to keep this percent of all cpus idle (0 to disable)
+    bool     sched_idle;  // run hashing threads (but not control one) with SCHED_IDLE policy
+    int      nice;        // nice level of hashing threads (0 to keep process one)
+    int      io_priority; // io priority of hashing threads: best effort 0-7, io_priority_idle or -1 to keep
+    unsigned max_usage;   // percent of time (1-100) each hashing thread may spend hashing
+    EngineOptions() : threads(1), affinity(false), idle_target(0), sched_idle(false), nice(0), io_priority(-1), max_usage(100) {}
+};
+
+// receives messages produced by the engine and its hashing threads (called from any of them)
+class EngineListener {
+
+    public:
+
+        virtual ~EngineListener() {}
+        virtual void send(const Message& msg) = 0;
+        virtual void send(const Result& result) = 0;
+};
+
+// job prepared by control thread for one hashing thread: blob replicated per way with first nonces and,
+// if scratchpad size changes, pre-faulted scratchpads, so hashing thread switches jobs by swapping pointers
+struct StagedJob {
+    Job        job;
+    uint8_t    blob[max_ways * max_blob_len];
+    uint64_t   nonce;              // index of next nonce after ones already put into blob
+    unsigned   active_ways;        // first ways that got nonces of the range (less than job ways near its end)
+    unsigned   ways;               // number of scratchpads owned (0 if previous ones are kept)
+    unsigned   mem;
+    uint8_t*   memory[max_ways];
+    StagedJob* next;               // in list of jobs retired by hashing thread
+    bool       release;            // hashing thread retires its scratchpads instead of taking them into this job
+    StagedJob() : nonce(0), active_ways(0), ways(0), mem(0), memory(), next(nullptr), release(false) {}
+    ~StagedJob() {
+        freeMemory();
+    }
+    void freeMemory() {
+        for (unsigned i = 0; i != ways; ++i) _mm_free(memory[i]);
+        ways = 0;
+    }
+    // takes scratchpads of other job that is going to be retired
+    void takeMemory(StagedJob& other) {
+        ways = other.ways;
+        mem  = other.mem;
+        memcpy(memory, other.memory, sizeof(memory));
+        other.ways = 0;
+    }
+    // continues nonces of other job with the same work from where it stopped (nonces in its blob were not hashed yet)
+    void takeProgress(const StagedJob& other) {
+        memcpy(blob, other.blob, job.ways * job.blob_len);
+        nonce       = other.nonce;
+        active_ways = other.active_ways;
+    }
+};
+
+// native hashing thread with its own scratchpads that covers [nonce_first, nonce_last) of every job
+class HashThread {
+
+    private:
+
+        EngineListener&         m_listener;
+        const EngineOptions     m_options;
+        const unsigned          m_index;
+        std::mutex              m_job_mutex;
+        std::condition_variable m_job_cond; // wakes up paused thread on new job or stop
+        std::atomic<StagedJob*> m_staged;   // shadow slot with the next job, taken by hashing thread
+        std::atomic<StagedJob*> m_retired;  // jobs (and scratchpads) replaced in hashing thread, freed by control thread
+        std::deque<std::unique_ptr<StagedJob>> m_resumable; // the latest replaced jobs with their nonce progress (control thread only)
+        unsigned                m_staged_ways; // scratchpads hashing thread has once it takes all staged jobs
+        unsigned                m_staged_mem;
+        std::atomic<uint32_t>   m_job_gen;  // bumped on every setJob so hot loop only checks it instead of locking
+        std::atomic<uint32_t>   m_update_gen; // bumped instead of m_job_gen for job with the same work, so kernel does not abandon its hash
+        std::atomic<uint32_t>   m_taken_gen; // the latest generation hashing thread switched to (after retiring its previous job)
+        bool                    m_releasing; // scratchpads are being released to hashing thread
+        std::atomic<bool>       m_stop;
+        std::atomic<bool>       m_parked;   // parked thread keeps its job and scratchpads, so it resumes at once
+        std::atomic<unsigned>   m_max_usage;
+        std::atomic<uint64_t>   m_hash_count;
+        std::atomic<uint64_t>   m_local_hits; // hashes below local target, they never leave the thread
+        std::thread             m_thread;
+
+        void sendError(const char* const sz) {
+            MessageValues values;
+            values["message"] = sz;
+            m_listener.send(Message("error", values));
+        }
+
+        // sleeps for (100 - max_usage)/max_usage of hashing time, sleeps shorter than 1 ms are accumulated
+        // in sleep_debt and oversleeping is paid back, so average duty cycle does not depend on timer precision
+        void throttle(const std::chrono::steady_clock::time_point hash_start, const unsigned max_usage,
+                      std::chrono::steady_clock::duration& sleep_debt, const uint32_t job_gen) {
+            const std::chrono::steady_clock::time_point hash_end = std::chrono::steady_clock::now();
+            sleep_debt += (hash_end - hash_start) * (100 - max_usage) / max_usage;
+            if (sleep_debt < std::chrono::milliseconds(1)) return;
+            std::unique_lock<std::mutex> locker(m_job_mutex);
+            m_job_cond.wait_for(locker, sleep_debt, [this, job_gen]() {
+                return m_job_gen.load(std::memory_order_relaxed) != job_gen || m_stop.load(std::memory_order_relaxed);
+            });
+            locker.unlock();
+            sleep_debt = std::max<std::chrono::steady_clock::duration>(sleep_debt - (std::chrono::steady_clock::now() - hash_end), -std::chrono::milliseconds(10));
+        }
+
+        // the last thread of job group that hashed all its nonces reports it
+        void rangeEnd(const Job& job) {
+            if (!job.ranges_left || job.ranges_left->fetch_sub(1) != 1) return;
+            MessageValues values;
+            if (job.id[0]) values["job_id"] = job.id;
+            m_listener.send(Message("range_end", values));
+        }
+
+        // checks hashes of active ways and puts next nonces of the range into blob, returns new number of active ways
+        template<typename Nonce> unsigned nextHashes(const Job& job, uint8_t* const blob, uint8_t* const hash, const unsigned ways,
+                                                    const unsigned active_ways, uint64_t& nonce, uint64_t& local_hits) {
+            for (unsigned i = 0; i != active_ways; ++i) {
+                const uint64_t result = *p_result(hash, i);
+                if (result < job.local_target) m_local_hits.store(++ local_hits, std::memory_order_relaxed);
+                // full compare runs only for hashes that pass 64-bit prefilter
+                if (result <= job.target_max && (!job.full_target || hash_not_above(hash + i * hash_len, job.target256))) {
+                    Result result;
+                    result.nonce  = get_nonce<Nonce>(blob, job.blob_len, job.nonce_offset, i);
+                    result.thread = m_index;
+                    result.way    = i;
+                    memcpy(result.hash, hash + i * hash_len, hash_len);
+                    memcpy(result.job_id, job.id, sizeof(result.job_id));
+                    result.found_ns = steady_ns();
+                    m_listener.send(result);
+                }
+            }
+            // ways past the end of range are still hashed by kernel, but their hashes are ignored
+            const unsigned next_ways = std::min<uint64_t>(ways, job.nonce_last - nonce);
+            for (unsigned i = 0; i != next_ways; ++i) set_nonce<Nonce>(blob, job.blob_len, job.nonce_offset, i, static_cast<Nonce>(job.nonce(nonce++)));
+            return next_ways;
+        }
+
+        void retire(StagedJob* const staged) {
+            staged->next = m_retired.load(std::memory_order_relaxed);
+            while (!m_retired.compare_exchange_weak(staged->next, staged, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        // puts job into shadow slot and tells hashing thread to take it (called from control thread only),
+        // abandoning hash in progress only if abort is set
+        void stage(StagedJob* const staged, const bool abort = true) {
+            const Job& job = staged->job;
+            // job that was not taken yet is replaced, but scratchpads it brought are still needed
+            StagedJob* const replaced = m_staged.exchange(nullptr, std::memory_order_acquire);
+            reclaim();
+            // progress of the same work replaced before (hashing thread takes it from its current job itself)
+            if (replaced && job.sameWork(replaced->job)) staged->takeProgress(*replaced);
+            else for (std::deque<std::unique_ptr<StagedJob>>::iterator pi = m_resumable.begin(); pi != m_resumable.end(); ++ pi) {
+                if (!job.sameWork((*pi)->job)) continue;
+                staged->takeProgress(**pi);
+                m_resumable.erase(pi);
+                break;
+            }
+            if (replaced) {
+                if (replaced->ways && !staged->ways && !staged->release) staged->takeMemory(*replaced);
+                delete replaced;
+            }
+            m_staged.store(staged, std::memory_order_release);
+            std::unique_lock<std::mutex> locker(m_job_mutex);
+            (abort ? m_job_gen : m_update_gen).fetch_add(1, std::memory_order_release);
+            locker.unlock();
+            m_job_cond.notify_one();
+        }
+
+        void run() {
+            if (!set_thread_priority(m_options.sched_idle, m_options.nice)) sendError("Can't set hashing thread priority");
+            if (m_options.io_priority >= 0 && !set_thread_io_priority(m_options.io_priority)) sendError("Can't set hashing thread io priority");
+
+            StagedJob* current = new StagedJob();
+            struct cryptonight_ctx ctx_mem[max_ways] = {};
+            struct cryptonight_ctx* ctx[max_ways];
+            unsigned ways = 0;
+            unsigned active_ways = 0;
+            uint8_t* blob = current->blob;
+            uint8_t hash[max_ways * hash_len];
+            uint64_t nonce = 0;
+            uint64_t hash_count = 0;
+            uint64_t local_hits = 0;
+            uint32_t job_gen = 0;
+            uint32_t update_gen = 0;
+            bool hashed = false; // hash has hashes of blob nonces that were not checked yet
+            std::chrono::steady_clock::duration sleep_debt(0);
+
+            for (unsigned i = 0; i != max_ways; ++i) ctx[i] = &ctx_mem[i];
+            ctx[0]->epoch = &m_job_gen;
+
+            while (!m_stop.load(std::memory_order_relaxed)) {
+                if (m_job_gen.load(std::memory_order_acquire) != job_gen || m_update_gen.load(std::memory_order_acquire) != update_gen) {
+                    job_gen    = m_job_gen.load(std::memory_order_relaxed);
+                    update_gen = m_update_gen.load(std::memory_order_relaxed);
+                    ctx[0]->start_epoch = job_gen;
+                    // nothing is staged if job of this generation was already taken with the previous one
+                    StagedJob* const staged = m_staged.exchange(nullptr, std::memory_order_acquire);
+                    if (staged) {
+                        if (!staged->ways && !staged->release) staged->takeMemory(*current);
+                        // resent job continues from the current nonce instead of hashing its nonces again
+                        current->nonce       = nonce;
+                        current->active_ways = active_ways;
+                        // hashes of the same blob are checked against the new job target (and reported with its id)
+                        if (staged->job.sameWork(current->job)) staged->takeProgress(*current);
+                        else hashed = false;
+                        retire(current);
+                        current = staged;
+                        ways    = current->ways;
+                        blob    = current->blob;
+                        nonce   = current->nonce;
+                        active_ways = current->active_ways;
+                        for (unsigned i = 0; i != ways; ++i) ctx[i]->memory = current->memory[i];
+                        if (current->job.fn && !active_ways) rangeEnd(current->job);
+                    }
+                    m_taken_gen.store(job_gen, std::memory_order_release);
+                }
+                const Job& job = current->job;
+                if (job.fn && active_ways && !m_parked.load(std::memory_order_relaxed)) {
+                    const unsigned max_usage = m_max_usage.load(std::memory_order_relaxed);
+                    const bool throttled = max_usage < 100 && !hashed;
+                    const std::chrono::steady_clock::time_point hash_start = throttled ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                    if (!hashed) {
+                        job.fn(blob, job.blob_len, hash, ctx);
+                        // hash was abandoned by kernel because of new job
+                        if (m_job_gen.load(std::memory_order_relaxed) != job_gen) continue;
+                        m_hash_count.store(hash_count += active_ways, std::memory_order_relaxed);
+                        // the same job resent with new target or id is taken first
+                        hashed = true;
+                        if (m_update_gen.load(std::memory_order_acquire) != update_gen) continue;
+                    }
+                    hashed = false;
+                    active_ways = job.nonce_width == sizeof(uint64_t) ? nextHashes<uint64_t>(job, blob, hash, ways, active_ways, nonce, local_hits)
+                                                                      : nextHashes<uint32_t>(job, blob, hash, ways, active_ways, nonce, local_hits);
+                    if (!active_ways) rangeEnd(job);
+                    if (throttled) throttle(hash_start, max_usage, sleep_debt, job_gen);
+                } else {
+                    std::unique_lock<std::mutex> locker(m_job_mutex);
+                    m_job_cond.wait(locker, [this, job_gen, update_gen, &job, active_ways]() {
+                        return m_job_gen.load(std::memory_order_relaxed) != job_gen || m_update_gen.load(std::memory_order_relaxed) != update_gen ||
+                               m_stop.load(std::memory_order_relaxed) ||
+                               (job.fn && active_ways && !m_parked.load(std::memory_order_relaxed));
+                    });
+                }
+            }
+            delete current;
+        }
+
+    public:
+
+        HashThread(EngineListener& listener, const EngineOptions& options, const unsigned index)
+            : m_listener(listener), m_options(options), m_index(index), m_staged(nullptr), m_retired(nullptr), m_staged_ways(0), m_staged_mem(0), m_job_gen(0), m_update_gen(0), m_taken_gen(0), m_releasing(false), m_stop(false), m_parked(false), m_max_usage(options.max_usage), m_hash_count(0),
+              m_local_hits(0), m_thread(&HashThread::run, this)
+            {
+            }
+
+        ~HashThread() {
+            stop();
+            m_thread.join();
+            delete m_staged.load();
+            reclaim();
+        }
+
+        void stop() {
+            std::unique_lock<std::mutex> locker(m_job_mutex);
+            m_stop = true;
+            locker.unlock();
+            m_job_cond.notify_one();
+        }
+
+        // prepares job in shadow slot (called from control thread only), so hashing thread does not
+        // decode, allocate or free anything on job switch (abort is false for job with the same work)
+        void setJob(const Job& job, const bool abort = true) {
+            StagedJob* const staged = new StagedJob();
+            staged->job = job;
+            if (job.fn) {
+                uint64_t nonce = job.nonce_first;
+                for (unsigned i = 0; i != job.ways; ++i) {
+                    memcpy(staged->blob + job.blob_len*i, job.blob, job.blob_len);
+                    if (nonce == job.nonce_last) continue;
+                    job.setNonce(staged->blob, i, job.nonce(nonce++));
+                    ++ staged->active_ways;
+                }
+                staged->nonce = nonce;
+                if (job.ways != m_staged_ways || job.mem != m_staged_mem) {
+                    staged->ways = job.ways;
+                    staged->mem  = job.mem;
+                    for (unsigned i = 0; i != job.ways; ++i) {
+                        staged->memory[i] = static_cast<uint8_t*>(_mm_malloc(job.mem, 4096));
+                        if (!staged->memory[i]) {
+                            staged->ways = i;
+                            delete staged;
+                            sendError("Can't allocate scratchpad memory");
+                            setJob(Job());
+                            return;
+                        }
+                        // touch every page now instead of page faulting in kernel
+                        memset(staged->memory[i], 0, job.mem);
+                    }
+                    m_staged_ways = job.ways;
+                    m_staged_mem  = job.mem;
+                }
+            }
+            stage(staged, abort);
+        }
+
+        // makes hashing thread give its scratchpads back before job that needs ones of other size is set (called
+        // from control thread only before awaitRelease), so that old and new ones are never allocated at once
+        void releaseMemory(const Job& job) {
+            if (!job.fn || !m_staged_ways || (job.ways == m_staged_ways && job.mem == m_staged_mem)) return;
+            StagedJob* const staged = new StagedJob();
+            staged->release = true;
+            m_staged_ways = 0;
+            m_staged_mem  = 0;
+            m_releasing   = true;
+            stage(staged);
+        }
+
+        // waits until hashing thread retires its scratchpads after releaseMemory and frees them
+        void awaitRelease() {
+            if (!m_releasing) return;
+            m_releasing = false;
+            // kernel abandons current hash on new job, so it does not take long
+            const uint32_t job_gen = m_job_gen.load(std::memory_order_relaxed);
+            while (m_taken_gen.load(std::memory_order_acquire) != job_gen) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            reclaim();
+        }
+
+        // frees scratchpads hashing thread is done with and keeps the latest jobs it replaced to resume them
+        // later (called from control thread only)
+        void reclaim() {
+            std::deque<std::unique_ptr<StagedJob>> retired;
+            for (StagedJob* staged = m_retired.exchange(nullptr, std::memory_order_acquire); staged; ) {
+                StagedJob* const next = staged->next;
+                staged->freeMemory();
+                retired.emplace_front(staged); // list has the latest job first
+                staged = next;
+            }
+            for (std::unique_ptr<StagedJob>& staged : retired) {
+                if (staged->job.fn) m_resumable.push_front(std::move(staged));
+            }
+            if (m_resumable.size() > max_resumable_jobs) m_resumable.resize(max_resumable_jobs);
+        }
+
+        void setParked(const bool parked) {
+            std::unique_lock<std::mutex> locker(m_job_mutex);
+            m_parked = parked;
+            locker.unlock();
+            m_job_cond.notify_one();
+        }
+
+        void setMaxUsage(const unsigned max_usage) {
+            m_max_usage = max_usage;
+        }
+
+        uint64_t hashCount() const {
+            return m_hash_count.load(std::memory_order_relaxed);
+        }
+
+        uint64_t localHits() const {
+            return m_local_hits.load(std::memory_order_relaxed);
+        }
+
+        bool setAffinity(const unsigned cpu) {
+            return set_thread_affinity(m_thread, cpu);
+        }
+};
+
+// pool of hashing threads, every job goes to all threads or to the group of threads given in its "threads"
+// list (so different algos can run side by side) and nonce space is split evenly within the group
+class Engine {
+
+    private:
+
+        EngineListener&                          m_listener;
+        EngineOptions                            m_options;
+        std::vector<std::unique_ptr<HashThread>> m_threads;
+        std::vector<CacheDomain>                 m_cache_domains;
+        uint64_t                                 m_thread_mem;
+        uint64_t                                 m_memory_budget; // for scratchpads of all threads
+        unsigned                                 m_auto_ways;
+        unsigned                                 m_active_threads; // threads that are not parked
+        std::vector<bool>                        m_thread_parked;
+        CpuTimes                                 m_cpu_times;
+        uint64_t                                 m_load_timestamp;
+        std::vector<Job>                         m_thread_jobs;        // last job given to every thread
+        std::vector<uint64_t>                    m_thread_hash_counts; // at the start of hashrate period
+        std::vector<uint64_t>                    m_thread_local_hits;  // at the start of hashrate period
+        std::deque<std::shared_ptr<const JobRequest>> m_recent_jobs;   // the latest jobs with ids, for "resume" message
+        uint64_t                                 m_timestamp;
+
+        void sendError(const char* const sz) {
+            MessageValues values;
+            values["message"] = sz;
+            m_listener.send(Message("error", values));
+        }
+
+        bool isHashing() const {
+            for (const Job& job : m_thread_jobs) if (job.fn) return true;
+            return false;
+        }
+
+        // repins threads when size of their (biggest) scratchpads changes and reports new thread to cpu mapping
+        void updateAffinity() {
+            uint64_t thread_mem = 0;
+            for (const Job& job : m_thread_jobs) thread_mem = std::max(thread_mem, static_cast<uint64_t>(job.ways) * job.mem);
+            if (!m_options.affinity || m_cache_domains.empty() || !thread_mem || m_thread_mem == thread_mem) return;
+            m_thread_mem = thread_mem;
+            unsigned cache_fit = 0;
+            const std::vector<unsigned> plan = plan_affinity(m_cache_domains, m_threads.size(), thread_mem, cache_fit);
+            std::string cpus;
+            for (size_t i = 0; i != plan.size(); ++i) {
+                if (!m_threads[i]->setAffinity(plan[i])) {
+                    sendError("Can't set thread affinity");
+                    return;
+                }
+                if (i) cpus += ",";
+                cpus += std::to_string(plan[i]);
+            }
+            MessageValues values;
+            values["cpus"]      = cpus;
+            values["cache_fit"] = std::to_string(cache_fit);
+            m_listener.send(Message("affinity", values));
+        }
+
+        // max ways that keep scratchpads of all threads within memory budget and (if known) L3 caches
+        unsigned autoWays(const unsigned mem) {
+            const uint64_t threads_mem = static_cast<uint64_t>(m_threads.size()) * mem;
+            uint64_t ways = std::min<uint64_t>(max_ways, m_memory_budget / threads_mem);
+            uint64_t l3_size = 0;
+            for (const CacheDomain& domain : m_cache_domains) l3_size += domain.size;
+            if (l3_size) ways = std::min(ways, l3_size / threads_mem);
+            if (ways == 0) ways = 1;
+            if (ways != m_auto_ways) {
+                m_auto_ways = ways;
+                MessageValues values;
+                values["ways"] = std::to_string(ways);
+                m_listener.send(Message("ways", values));
+            }
+            return ways;
+        }
+
+        // parses list of distinct thread indexes like "0-3,8" (all threads if it is empty)
+        bool parseThreads(const std::string& list, std::vector<unsigned>& threads) {
+            if (list.empty()) {
+                for (unsigned i = 0; i != m_threads.size(); ++i) threads.push_back(i);
+                return true;
+            }
+            threads = parse_cpu_list(list, m_threads.size());
+            std::vector<unsigned> sorted_threads = threads;
+            std::sort(sorted_threads.begin(), sorted_threads.end());
+            // thread listed twice would get two parts of nonces and hash only the last one
+            if (threads.empty() || std::adjacent_find(sorted_threads.begin(), sorted_threads.end()) != sorted_threads.end()) {
+                sendError("Bad threads");
+                return false;
+            }
+            return true;
+        }
+
+        // true if other thread of the job group of thread index is not parked (or that thread has no job)
+        bool groupHasOtherActive(const unsigned index) const {
+            const Job& job = m_thread_jobs[index];
+            if (!job.fn) return true;
+            for (unsigned i = 0; i != m_threads.size(); ++i) {
+                if (i != index && !m_thread_parked[i] && m_thread_jobs[i].ranges_left == job.ranges_left) return true;
+            }
+            return false;
+        }
+
+        void setParked(const unsigned index, const bool parked) {
+            m_thread_parked[index] = parked;
+            m_threads[index]->setParked(parked);
+            if (parked) -- m_active_threads;
+            else ++ m_active_threads;
+        }
+
+        void sendThreads() {
+            MessageValues values;
+            values["threads"] = std::to_string(m_threads.size());
+            values["active"]  = std::to_string(m_active_threads);
+            m_listener.send(Message("threads", values));
+        }
+
+        // unparks one thread of every job group that has all its threads parked (after threads changed groups)
+        void unparkIdleGroups() {
+            bool changed = false;
+            for (unsigned i = 0; i != m_threads.size(); ++i) {
+                if (!m_thread_parked[i] || groupHasOtherActive(i)) continue;
+                setParked(i, false);
+                changed = true;
+            }
+            if (changed) sendThreads();
+        }
+
+        // gives job to the threads splitting indexes of its nonces between them
+        void setJob(Job job, const std::vector<unsigned>& threads, const uint64_t nonce_count = 1ULL << 32) {
+            const uint64_t nonce_span = nonce_count / threads.size();
+            if (job.fn) job.ranges_left = std::make_shared<std::atomic<unsigned>>(threads.size());
+            // scratchpads of other size are freed first (by all threads at once), so memory budget is never exceeded
+            for (const unsigned thread : threads) m_threads[thread]->releaseMemory(job);
+            for (const unsigned thread : threads) m_threads[thread]->awaitRelease();
+            for (unsigned i = 0; i != threads.size(); ++i) {
+                job.nonce_first = nonce_span * i;
+                job.nonce_last  = i == threads.size() - 1 ? nonce_count : job.nonce_first + nonce_span;
+                // resent job only changes target and id of the same work, so hash in progress is kept
+                m_threads[threads[i]]->setJob(job, !job.sameWork(m_thread_jobs[threads[i]]));
+                // restart hashrate period if any thread switches algo
+                if (m_thread_jobs[threads[i]].fn != job.fn) m_timestamp = 0;
+                m_thread_jobs[threads[i]] = job;
+            }
+            unparkIdleGroups();
+        }
+
+        // parses pool target hex: 32-bit one (scaled to 64 bits, its exact difficulty is returned too) or 64-bit one
+        static bool parseTarget(const std::string& target_str, uint64_t& target, uint64_t& difficulty) {
+            difficulty = 0;
+            if (target_str.size() <= sizeof(uint32_t)*2) {
+                uint32_t tmp = 0;
+                char str[sizeof(uint32_t)*2 + 1] = "00000000";
+                memcpy(str, target_str.c_str(), target_str.size());
+                if (!fromHex(str, sizeof(uint32_t), reinterpret_cast<unsigned char*>(&tmp)) || tmp == 0) return false;
+                difficulty = 0xFFFFFFFFULL / static_cast<uint64_t>(tmp);
+                target = 0xFFFFFFFFFFFFFFFFULL / difficulty;
+                return true;
+            } else if (target_str.size() <= sizeof(uint64_t)*2) {
+                uint64_t tmp = 0;
+                char str[sizeof(uint64_t)*2 + 1] = "0000000000000000";
+                memcpy(str, target_str.c_str(), target_str.size());
+                if (!fromHex(str, sizeof(uint64_t), reinterpret_cast<unsigned char*>(&tmp)) || tmp == 0) return false;
+                target = tmp;
+                return true;
+            }
+            return false;
+        }
+
+        // decodes hex strings of "job" message
+        bool parseJob(const MessageValues& values, JobRequest& request) {
+            const std::string new_ways_str   = values.at("ways");
+            const std::string new_blob_str   = values.at("blob_hex");
+            const char* const new_blob_hex   = new_blob_str.c_str();
+            const unsigned new_blob_len2     = new_blob_str.size();
+            const unsigned new_blob_len      = new_blob_len2 >> 1;
+            const std::string new_target_str = values.at("target");
+            const MessageValues::const_iterator pi_local_target = values.find("local_target");
+
+            if ((new_blob_len2 & 1) || new_blob_len > max_blob_len) {
+                sendError("Bad blob length");
+                return false;
+            }
+            if (!fromHex(new_blob_hex, new_blob_len, request.blob)) {
+                sendError("Bad blob hex");
+                return false;
+            }
+            uint64_t local_difficulty;
+            if (new_target_str.size() == hash_len*2) {
+                // full 256-bit target
+                request.full_target = fromHex(new_target_str.c_str(), hash_len, request.target256);
+                if (!request.full_target) {
+                    sendError("Bad target hex");
+                    return false;
+                }
+            } else if (!parseTarget(new_target_str, request.target, request.difficulty)) {
+                sendError("Bad target hex");
+                return false;
+            }
+            if (pi_local_target != values.end() && !parseTarget(pi_local_target->second, request.local_target, local_difficulty)) {
+                sendError("Bad target hex");
+                return false;
+            }
+            const MessageValues::const_iterator pi_difficulty = values.find("difficulty");
+            if (pi_difficulty != values.end()) request.difficulty = strtoull(pi_difficulty->second.c_str(), nullptr, 10);
+            request.algo     = values.at("algo");
+            request.soft_aes = atoi(values.at("soft_aes").c_str()) != 0;
+            request.ways     = new_ways_str == "auto" ? 0 : atoi(new_ways_str.c_str());
+            request.blob_len = new_blob_len;
+            const MessageValues::const_iterator pi_id = values.find("job_id");
+            if (pi_id != values.end()) request.job_id = pi_id->second;
+            const MessageValues::const_iterator pi_threads = values.find("threads");
+            if (pi_threads != values.end()) request.threads = pi_threads->second;
+            const MessageValues::const_iterator pi_nonce_offset = values.find("nonce_offset");
+            if (pi_nonce_offset != values.end()) {
+                const long nonce_offset = strtol(pi_nonce_offset->second.c_str(), nullptr, 10);
+                if (nonce_offset < 0 || nonce_offset >= static_cast<long>(max_blob_len)) {
+                    sendError("Bad nonce offset");
+                    return false;
+                }
+                request.nonce_offset = nonce_offset;
+            }
+            const MessageValues::const_iterator pi_nonce_width = values.find("nonce_width");
+            if (pi_nonce_width != values.end()) {
+                const long nonce_width = strtol(pi_nonce_width->second.c_str(), nullptr, 10);
+                if (nonce_width != static_cast<long>(sizeof(uint32_t)) && nonce_width != static_cast<long>(sizeof(uint64_t))) {
+                    sendError("Bad nonce width");
+                    return false;
+                }
+                request.nonce_width = nonce_width;
+            }
+            const MessageValues::const_iterator pi_nonce_start = values.find("nonce_start");
+            if (pi_nonce_start != values.end()) request.nonce_start = strtoull(pi_nonce_start->second.c_str(), nullptr, 10);
+            const MessageValues::const_iterator pi_nonce_end = values.find("nonce_end");
+            if (pi_nonce_end != values.end()) request.nonce_end = strtoull(pi_nonce_end->second.c_str(), nullptr, 10);
+            const MessageValues::const_iterator pi_nonce_stride = values.find("nonce_stride");
+            if (pi_nonce_stride != values.end()) request.nonce_stride = strtoull(pi_nonce_stride->second.c_str(), nullptr, 10);
+            const MessageValues::const_iterator pi_nonce_partition = values.find("nonce_partition");
+            if (pi_nonce_partition != values.end()) request.nonce_partition = strtoull(pi_nonce_partition->second.c_str(), nullptr, 10);
+            return true;
+        }
+
+        // resolves kernel and scratchpad size of job request, returns number of its nonces in nonce_count
+        bool makeJob(const JobRequest& request, Job& job, uint64_t& nonce_count) {
+            const std::map<std::string, unsigned>::const_iterator pi_mem = algo2mem.find(request.algo);
+            if (pi_mem == algo2mem.end()) {
+                sendError("Unsupported algo");
+                return false;
+            }
+            const unsigned new_ways = request.ways ? request.ways : autoWays(pi_mem->second);
+            if (new_ways < 1 || new_ways > max_ways) {
+                sendError("Unsupported ways");
+                return false;
+            }
+            const unsigned is_soft_aes = request.soft_aes ? 1 : 0;
+            const std::map<std::string, cn_hash_fun>::const_iterator pi_fn = algo2fn[new_ways-1][is_soft_aes].find(request.algo);
+            if (pi_fn == algo2fn[new_ways-1][is_soft_aes].end()) {
+                sendError("Unsupported algo");
+                return false;
+            }
+            if (request.nonce_width != sizeof(uint32_t) && request.nonce_width != sizeof(uint64_t)) {
+                sendError("Bad nonce width");
+                return false;
+            }
+            // nonce offset is checked first, so that offset + width can not wrap
+            if (request.blob_len < min_blob_len || request.blob_len >= max_blob_len || request.nonce_offset >= max_blob_len ||
+                request.nonce_offset + request.nonce_width > request.blob_len) {
+                sendError("Bad blob length");
+                return false;
+            }
+            if (request.target == 0 && request.difficulty == 0 && !request.full_target) {
+                sendError("Bad target");
+                return false;
+            }
+            if (request.job_id.size() > max_job_id_len) {
+                sendError("Too long job id");
+                return false;
+            }
+            // inclusive bounds, so that 64-bit nonce space end fits too
+            const uint64_t nonce_max  = request.nonce_width == sizeof(uint64_t) ? 0xFFFFFFFFFFFFFFFFULL : 0xFFFFFFFFULL;
+            const uint64_t nonce_last = request.nonce_end ? request.nonce_end - 1 : nonce_max;
+            if (request.nonce_stride == 0 || request.nonce_partition >= request.nonce_stride ||
+                request.nonce_start > nonce_last || nonce_last > nonce_max) {
+                sendError("Bad nonce range");
+                return false;
+            }
+            job.fn       = pi_fn->second;
+            job.ways     = new_ways;
+            job.mem      = pi_mem->second;
+            job.blob_len = request.blob_len;
+            // exact difficulty (also derived from 32-bit pool target) or 256-bit target go through full compare
+            job.full_target = request.difficulty || request.full_target;
+            if (request.difficulty) difficulty_target(request.difficulty, job.target256);
+            else if (request.full_target) memcpy(job.target256, request.target256, hash_len);
+            if (job.full_target) memcpy(&job.target_max, job.target256 + 24, sizeof(job.target_max));
+            else job.target_max = request.target - 1;
+            // local target can only be easier than the real one
+            job.local_target = request.local_target ? std::max(request.local_target, job.target_max) : 0;
+            memcpy(job.blob, request.blob, request.blob_len);
+            strcpy(job.id, request.job_id.c_str());
+            job.nonce_offset = request.nonce_offset;
+            job.nonce_width  = request.nonce_width;
+            job.nonce_base   = request.nonce_start + request.nonce_partition;
+            job.nonce_stride = request.nonce_stride;
+            if (request.nonce_partition > nonce_last - request.nonce_start) nonce_count = 0;
+            else {
+                const uint64_t nonce_steps = (nonce_last - job.nonce_base) / job.nonce_stride;
+                // full 64-bit nonce space is one nonce short, but nobody is going to hash it all anyway
+                nonce_count = nonce_steps == 0xFFFFFFFFFFFFFFFFULL ? nonce_steps : nonce_steps + 1;
+            }
+            return true;
+        }
+
+        // parks or unparks one thread every couple of seconds to keep idle_target percent of cpus idle
+        void balanceLoad(const uint64_t timestamp) {
+            if (!m_options.idle_target || timestamp - m_load_timestamp < 2*1000) return;
+            m_load_timestamp = timestamp;
+            CpuTimes cpu_times;
+            if (!read_cpu_times(cpu_times)) return;
+            const CpuTimes prev_cpu_times = m_cpu_times;
+            m_cpu_times = cpu_times;
+            if (!prev_cpu_times.total || cpu_times.total == prev_cpu_times.total) return;
+            const double idle = 100.0 * (cpu_times.idle - prev_cpu_times.idle) / (cpu_times.total - prev_cpu_times.total);
+            // parking is disabled unless this process can use all cpus /proc/stat counts
+            const double thread_share = 100.0 / std::max(1U, std::thread::hardware_concurrency());
+            // the last active thread of job group is never parked, so that every group keeps hashing
+            if (idle < m_options.idle_target) {
+                unsigned index = m_threads.size();
+                while (index && (m_thread_parked[index - 1] || !groupHasOtherActive(index - 1))) -- index;
+                if (!index) return;
+                setParked(index - 1, true);
+            } else if (idle - thread_share > m_options.idle_target && m_active_threads < m_threads.size()) {
+                unsigned index = 0;
+                while (!m_thread_parked[index]) ++ index;
+                setParked(index, false);
+            } else {
+                return;
+            }
+            sendThreads();
+        }
+
+    public:
+
+        Engine(EngineListener& listener, const EngineOptions& options)
+            : m_listener(listener), m_options(options), m_thread_mem(0), m_memory_budget(0), m_auto_ways(0), m_active_threads(0), m_load_timestamp(0), m_timestamp(0)
+            {
+                const uint64_t memory = available_memory();
+                m_memory_budget = memory > auto_mem_reserve ? memory - auto_mem_reserve : 0;
+                unsigned threads = options.threads;
+                if (!threads) {
+                    // so that even the biggest cn-heavy scratchpad of each thread fits
+                    const double cpus = available_cpus();
+                    threads = std::max<uint64_t>(1, std::min<uint64_t>(cpus, m_memory_budget / xmrig::CRYPTONIGHT_HEAVY_MEMORY));
+                    MessageValues values;
+                    values["threads"] = std::to_string(threads);
+                    values["cpus"]    = std::to_string(cpus);
+                    values["memory"]  = std::to_string(memory);
+                    m_listener.send(Message("threads", values));
+                }
+                for (unsigned i = 0; i != threads; ++i) m_threads.emplace_back(new HashThread(listener, options, i));
+                m_thread_jobs.resize(threads);
+                m_thread_hash_counts.resize(threads);
+                m_thread_local_hits.resize(threads);
+                m_active_threads = threads;
+                m_thread_parked.resize(threads);
+                m_cache_domains = cpu_cache_domains();
+                if (options.affinity && m_cache_domains.empty()) sendError("Can't detect cpu topology for thread affinity");
+                // /proc/stat idle is host wide, so it tells nothing about cpus left to this process by cgroup quota or affinity
+                if (options.idle_target && available_cpus() < std::thread::hardware_concurrency()) {
+                    m_options.idle_target = 0;
+                    sendError("idle_target is ignored as cpus of this process are limited by cgroup quota or affinity");
+                }
+            }
+
+        ~Engine() {
+            for (const std::unique_ptr<HashThread>& thread : m_threads) thread->stop();
+        }
+
+        // handles "job", "pause" (both for all threads or for ones in "threads" list), "resume" (of recent job
+        // with "job_id") and "throttle" messages, job that is sent again continues from nonces it got to
+        void onMessage(const Message& msg) {
+            if (msg.name == "job" || msg.name == "resume") {
+                // job from sendJob comes already decoded
+                std::shared_ptr<const JobRequest> request = msg.job;
+                if (msg.name == "resume") {
+                    const MessageValues::const_iterator pi_id = msg.values.find("job_id");
+                    request = nullptr;
+                    for (const std::shared_ptr<const JobRequest>& recent_job : m_recent_jobs) {
+                        if (pi_id != msg.values.end() && recent_job->job_id == pi_id->second) request = recent_job;
+                    }
+                    if (!request) {
+                        sendError("Unknown job id");
+                        return;
+                    }
+                } else if (!request) {
+                    std::shared_ptr<JobRequest> parsed_request = std::make_shared<JobRequest>();
+                    if (!parseJob(msg.values, *parsed_request)) return;
+                    request = parsed_request;
+                }
+                Job job;
+                std::vector<unsigned> threads;
+                uint64_t nonce_count;
+                if (!parseThreads(request->threads, threads) || !makeJob(*request, job, nonce_count)) return;
+                setJob(job, threads, nonce_count);
+                updateAffinity();
+                if (!request->job_id.empty()) {
+                    m_recent_jobs.erase(std::remove_if(m_recent_jobs.begin(), m_recent_jobs.end(), [&request](const std::shared_ptr<const JobRequest>& recent_job) {
+                        return recent_job->job_id == request->job_id;
+                    }), m_recent_jobs.end());
+                    m_recent_jobs.push_front(request);
+                    if (m_recent_jobs.size() > max_resumable_jobs) m_recent_jobs.pop_back();
+                }
+            } else if (msg.name == "pause") {
+                const MessageValues::const_iterator pi_threads = msg.values.find("threads");
+                std::vector<unsigned> threads;
+                if (!parseThreads(pi_threads == msg.values.end() ? "" : pi_threads->second, threads)) return;
+                setJob(Job(), threads);
+            } else if (msg.name == "throttle") {
+                m_options.max_usage = std::min(std::max(atoi(msg.values.at("max_usage").c_str()), 1), 100);
+                for (const std::unique_ptr<HashThread>& thread : m_threads) thread->setMaxUsage(m_options.max_usage);
+                m_timestamp = 0;
+            }
+        }
+
+        // reports hashrate aggregated over threads of every job (or of every thread group for jobs without id,
+        // with its first thread as "group") once a minute while hashing, for jobs with
+        // local target also effective hashrate estimated from local hits and its ratio to real hashrate
+        // for every thread (that is about 1 for threads that compute hashes correctly)
+        void tick() {
+            for (const std::unique_ptr<HashThread>& thread : m_threads) thread->reclaim();
+            if (!isHashing()) {
+                m_cpu_times = CpuTimes();
+                return;
+            }
+            const uint64_t new_timestamp  = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now()).time_since_epoch().count();
+            balanceLoad(new_timestamp);
+            if (!m_timestamp || new_timestamp - m_timestamp > 60*1000) {
+                struct JobRate {
+                    uint64_t    hash_count;
+                    uint64_t    local_hits;
+                    double      effective_count;
+                    std::string thread_efficiency;
+                    JobRate() : hash_count(0), local_hits(0), effective_count(0) {}
+                };
+                // by job id or, for jobs without id, by their group (its first thread)
+                std::map<std::pair<std::string, unsigned>, JobRate> job2rate;
+                std::map<const std::atomic<unsigned>*, unsigned> group2first;
+                for (unsigned i = 0; i != m_threads.size(); ++i) {
+                    const uint64_t new_hash_count = m_threads[i]->hashCount();
+                    const uint64_t new_local_hits = m_threads[i]->localHits();
+                    const Job& job = m_thread_jobs[i];
+                    if (job.fn) {
+                        const unsigned group = group2first.insert(std::make_pair(job.ranges_left.get(), i)).first->second;
+                        JobRate& rate = job2rate[std::make_pair(std::string(job.id), job.id[0] ? 0 : group)];
+                        const uint64_t hash_count = new_hash_count - m_thread_hash_counts[i];
+                        rate.hash_count += hash_count;
+                        if (job.local_target) {
+                            const uint64_t local_hits = new_local_hits - m_thread_local_hits[i];
+                            // every local hit stands for 2^64 / local_target hashes on average
+                            const double effective_count = local_hits * (18446744073709551616.0 / job.local_target);
+                            rate.local_hits      += local_hits;
+                            rate.effective_count += effective_count;
+                            if (hash_count) {
+                                if (!rate.thread_efficiency.empty()) rate.thread_efficiency += ",";
+                                rate.thread_efficiency += std::to_string(i) + ":" + std::to_string(static_cast<float>(effective_count / hash_count));
+                            }
+                        }
+                    }
+                    m_thread_hash_counts[i] = new_hash_count;
+                    m_thread_local_hits[i]  = new_local_hits;
+                }
+                if (m_timestamp) for (std::map<std::pair<std::string, unsigned>, JobRate>::const_iterator pi = job2rate.begin(); pi != job2rate.end(); ++ pi) {
+                    MessageValues values;
+                    values["hashrate"] = std::to_string(static_cast<float>(pi->second.hash_count) / (new_timestamp - m_timestamp) * 1000.0f);
+                    if (!pi->second.thread_efficiency.empty()) {
+                        values["local_hits"]         = std::to_string(pi->second.local_hits);
+                        values["effective_hashrate"] = std::to_string(static_cast<float>(pi->second.effective_count / (new_timestamp - m_timestamp) * 1000.0));
+                        values["thread_efficiency"]  = pi->second.thread_efficiency;
+                    }
+                    if (!pi->first.first.empty()) values["job_id"] = pi->first.first;
+                    else values["group"] = std::to_string(pi->first.second);
+                    if (m_options.max_usage < 100) values["max_usage"] = std::to_string(m_options.max_usage);
+                    m_listener.send(Message("hashrate", values));
+                }
+                m_timestamp = new_timestamp;
+            }
+        }
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <iterator>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+typedef std::map<std::string, std::string> MessageValues;
+
+const unsigned min_blob_len   = 43; // Monero variant kernels give zero hash for shorter blobs
+const unsigned max_blob_len   = 96;
+const unsigned hash_len       = 32;
+const unsigned max_job_id_len = 64;
+
+// job with binary blob and target, either decoded from "job" message strings or given by sendJob as is
+struct JobRequest {
+    std::string algo;
+    bool        soft_aes;
+    unsigned    ways;     // 0 to pick automatically
+    uint8_t     blob[max_blob_len];
+    unsigned    blob_len;
+    uint64_t    target;       // compared with top 64 bits of hash
+    uint64_t    difficulty;   // exact 256-bit target is (2^256 - 1) / difficulty if it is not 0
+    bool        full_target;  // target256 is set (hash is a result if it is not above it)
+    uint8_t     target256[hash_len]; // little endian like hash
+    uint64_t    local_target; // easier target which hits are only counted natively (0 to disable)
+    unsigned    nonce_offset; // nonce position in blob (39 for Monero blobs)
+    unsigned    nonce_width;  // 4 or 8 bytes of little endian nonce
+    uint64_t    nonce_start;  // [nonce_start, nonce_end) range of nonces to hash
+    uint64_t    nonce_end;    // 0 for the end of nonce space
+    uint64_t    nonce_stride; // only every nonce_stride-th nonce of range starting from nonce_partition one is hashed,
+    uint64_t    nonce_partition; // so nonce_stride workers with different partitions do not overlap
+    std::string job_id;
+    std::string threads;      // list of engine thread indexes like "0-3,8", empty for all threads
+    JobRequest() : soft_aes(false), ways(0), blob(), blob_len(0), target(0), difficulty(0), full_target(false), target256(), local_target(0),
+                   nonce_offset(39), nonce_width(4), nonce_start(0), nonce_end(0), nonce_stride(1), nonce_partition(0) {}
+
+    // setters shared by binary front-ends (sendJob, sickle-daemon and sickle-shm), engine makeJob checks the rest
+    bool setBlob(const void* const data, const size_t size) {
+        if (size > max_blob_len) return false;
+        memcpy(blob, data, size);
+        blob_len = size;
+        return true;
+    }
+    void setTarget256(const uint8_t* const target) {
+        memcpy(target256, target, hash_len);
+        full_target = true;
+    }
+    bool setNonceLayout(const int64_t offset, const int64_t width) {
+        if (offset < 0 || offset >= static_cast<int64_t>(max_blob_len)) return false;
+        if (width != static_cast<int64_t>(sizeof(uint32_t)) && width != static_cast<int64_t>(sizeof(uint64_t))) return false;
+        nonce_offset = offset;
+        nonce_width  = width;
+        return true;
+    }
+};
+
+struct Message {
+    std::string name;
+    MessageValues values;
+    std::shared_ptr<const JobRequest> job; // typed "job" message
+    Message(std::string name, MessageValues values, std::shared_ptr<const JobRequest> job = nullptr) : name(name), values(values), job(job) {}
+};
+
+// writes size low bytes of value little endian (for binary result records and frames of front-ends)
+static inline void put_le(uint8_t* const p, uint64_t value, const unsigned size) {
+    for (unsigned i = 0; i != size; ++i, value >>= 8) p[i] = static_cast<uint8_t>(value);
+}
+
+static inline void put_le(std::string& data, const uint64_t value, const unsigned size) {
+    uint8_t bytes[sizeof(value)];
+    put_le(bytes, value, size);
+    data.append(reinterpret_cast<const char*>(bytes), size);
+}
+
+// lower case hex of data (for result hashes and nonces in text messages)
+static inline std::string to_hex(const uint8_t* const data, const size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    std::string str(size * 2, '0');
+    for (size_t i = 0; i != size; ++i) {
+        str[i*2]     = hex[data[i] >> 4];
+        str[i*2 + 1] = hex[data[i] & 0xF];
+    }
+    return str;
+}
+
+// monotonic timestamp in nanoseconds used to measure result delivery latency
+static inline int64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// result of hashing thread, kept typed (without heap allocated strings) until it is delivered
+struct Result {
+    uint64_t nonce;
+    uint16_t thread;
+    uint8_t  way;
+    uint8_t  hash[hash_len];
+    char     job_id[max_job_id_len + 1];
+    int64_t  found_ns;  // steady_ns() when hashing thread found it
+    int64_t  queued_ns; // steady_ns() when it was put into to-Node queue
+};
+
+template<typename T> class MessageQueue {
+
+    private:
+
+        std::mutex              m_mutex;
+        std::condition_variable m_cond;
+        std::deque<T>           m_buff;
+        size_t                  m_high_water = 0;
+
+    public:
+
+        // returns queue size after write
+        size_t write(T data) {
+            while (true) {
+                std::unique_lock<std::mutex> locker(m_mutex);
+                m_buff.push_back(data);
+                const size_t size = m_buff.size();
+                m_high_water = std::max(m_high_water, size);
+                locker.unlock();
+                m_cond.notify_all();
+                return size;
+            }
+        }
+
+        // writes data only if queue has less than limit elements, returns false if data was dropped
+        bool write(T data, const size_t limit) {
+            std::unique_lock<std::mutex> locker(m_mutex);
+            if (m_buff.size() >= limit) return false;
+            m_buff.push_back(data);
+            m_high_water = std::max(m_high_water, m_buff.size());
+            locker.unlock();
+            m_cond.notify_all();
+            return true;
+        }
+
+        // replaces queued element for which same(element) is true with data or writes data if there is none,
+        // returns true if element was replaced
+        template<typename Same> bool writeCoalesced(T data, Same same) {
+            std::unique_lock<std::mutex> locker(m_mutex);
+            const typename std::deque<T>::iterator pi = std::find_if(m_buff.begin(), m_buff.end(), same);
+            const bool replaced = pi != m_buff.end();
+            if (replaced) *pi = data;
+            else m_buff.push_back(data);
+            m_high_water = std::max(m_high_water, m_buff.size());
+            locker.unlock();
+            m_cond.notify_all();
+            return replaced;
+        }
+
+        size_t size() {
+            std::unique_lock<std::mutex> locker(m_mutex);
+            return m_buff.size();
+        }
+
+        size_t highWater() {
+            std::unique_lock<std::mutex> locker(m_mutex);
+            return m_high_water;
+        }
+
+        T read() {
+            while (true)
+            {
+                std::unique_lock<std::mutex> locker(m_mutex);
+                m_cond.wait(locker, [this]() {
+                    return m_buff.size() > 0;
+                });
+                T back = m_buff.front();
+                m_buff.pop_front();
+                locker.unlock();
+                m_cond.notify_all();
+                return back;
+            }
+        }
+
+        void readAll(std::deque<T>& target) {
+            std::unique_lock<std::mutex> locker(m_mutex);
+            std::copy(m_buff.begin(), m_buff.end(), std::back_inserter(target));
+            m_buff.clear();
+            locker.unlock();
+        }
+
+        // same as readAll but waits up to timeout for at least one element
+        template<typename Rep, typename Period> void readAll(std::deque<T>& target, const std::chrono::duration<Rep, Period>& timeout) {
+            std::unique_lock<std::mutex> locker(m_mutex);
+            m_cond.wait_for(locker, timeout, [this]() {
+                return m_buff.size() > 0;
+            });
+            std::copy(m_buff.begin(), m_buff.end(), std::back_inserter(target));
+            m_buff.clear();
+            locker.unlock();
+        }
+};
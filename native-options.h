@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "engine.h"
+
+// option=value command line arguments of native front-ends (starting from argument first)
+static inline MessageValues parse_options(const int argc, const char* const argv[], const int first) {
+    MessageValues options;
+    for (int i = first; i < argc; ++i) {
+        const char* const eq = strchr(argv[i], '=');
+        if (eq) options[std::string(argv[i], eq - argv[i])] = eq + 1;
+    }
+    return options;
+}
+
+static inline std::string option(const MessageValues& options, const char* const name, const std::string& def) {
+    const MessageValues::const_iterator pi = options.find(name);
+    return pi == options.end() ? def : pi->second;
+}
+
+// engine options of addon worker JS options object (converted to strings) and of native front-ends
+static inline EngineOptions engine_options(const MessageValues& options) {
+    EngineOptions engine_options;
+    engine_options.threads     = atoi(option(options, "threads", "1").c_str()); // 0 or "auto" to size by cgroup limits
+    const std::string affinity = option(options, "affinity", "false");
+    engine_options.affinity    = affinity == "true" || affinity == "1";
+    engine_options.idle_target = atoi(option(options, "idle_target", "0").c_str());
+    // "idle" for SCHED_IDLE or nice level of hashing threads only
+    const std::string priority = option(options, "priority", "0");
+    engine_options.sched_idle  = priority == "idle";
+    engine_options.nice        = engine_options.sched_idle ? 0 : atoi(priority.c_str());
+    // "idle" or best effort level 0-7
+    const std::string io_priority = option(options, "io_priority", "-1");
+    engine_options.io_priority = io_priority == "idle" ? io_priority_idle : std::min(atoi(io_priority.c_str()), 7);
+    engine_options.max_usage   = std::min(std::max(atoi(option(options, "max_usage", "100").c_str()), 1), 100);
+    return engine_options;
+}
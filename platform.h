@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <thread>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+const int io_priority_idle = 8; // io_priority value that selects idle io class instead of best effort level
+
+// returns first line of a small sysfs/procfs file or empty string if it can not be read
+static inline std::string read_line(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+// parses Linux cpu list format like "0-3,8,10-11", returns empty list if any cpu is not below limit
+// (ranges are checked before they are expanded), any range is reversed or list has anything else in it
+static inline std::vector<unsigned> parse_cpu_list(const std::string& list, const unsigned limit) {
+    std::vector<unsigned> cpus;
+    const char* p = list.c_str();
+    while (*p) {
+        char* end;
+        if (*p < '0' || *p > '9') return std::vector<unsigned>();
+        const unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        p = end;
+        if (*p == '-') {
+            if (p[1] < '0' || p[1] > '9') return std::vector<unsigned>();
+            last = strtoul(p + 1, &end, 10);
+            p = end;
+        }
+        if (first > last || last >= limit) return std::vector<unsigned>();
+        for (unsigned cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        if (*p == ',' && p[1]) ++p;
+        else if (*p) return std::vector<unsigned>();
+    }
+    return cpus;
+}
+
+// parses sysfs cache size like "32768K"
+static inline uint64_t parse_size(const std::string& str) {
+    char* end;
+    const uint64_t size = strtoull(str.c_str(), &end, 10);
+    switch (*end) {
+        case 'K': return size << 10;
+        case 'M': return size << 20;
+        case 'G': return size << 30;
+        default:  return size;
+    }
+}
+
+// cpus that share one L3 cache (size is 0 if unknown)
+struct CacheDomain {
+    uint64_t              size;
+    std::vector<unsigned> cpus; // one cpu of every physical core first, then their SMT siblings
+    CacheDomain() : size(0) {}
+};
+
+// groups online cpus this process may run on (its affinity mask, like cpuset of container) by shared L3 cache
+// (or by package if there is no L3 info), empty if topology is unknown
+static inline std::vector<CacheDomain> cpu_cache_domains() {
+    std::vector<CacheDomain> domains;
+#if defined(__linux__)
+    std::map<std::string, size_t> key2domain;
+    std::vector<std::vector<unsigned>> siblings;
+    std::set<std::string> cores;
+    cpu_set_t allowed;
+    const bool has_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    for (const unsigned cpu : parse_cpu_list(read_line("/sys/devices/system/cpu/online"), CPU_SETSIZE)) {
+        if (has_allowed && !CPU_ISSET(cpu, &allowed)) continue;
+        const std::string base    = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        const std::string package = read_line(base + "/topology/physical_package_id");
+        std::string key = "package " + package;
+        uint64_t size = 0;
+        for (unsigned index = 0; ; ++index) {
+            const std::string cache = base + "/cache/index" + std::to_string(index);
+            const std::string level = read_line(cache + "/level");
+            if (level.empty()) break;
+            if (level == "3") {
+                key  = "l3 " + read_line(cache + "/shared_cpu_list");
+                size = parse_size(read_line(cache + "/size"));
+                break;
+            }
+        }
+        std::map<std::string, size_t>::const_iterator pi = key2domain.find(key);
+        if (pi == key2domain.end()) {
+            pi = key2domain.insert(std::make_pair(key, domains.size())).first;
+            domains.push_back(CacheDomain());
+            domains.back().size = size;
+            siblings.push_back(std::vector<unsigned>());
+        }
+        if (cores.insert(package + ":" + read_line(base + "/topology/core_id")).second) domains[pi->second].cpus.push_back(cpu);
+        else siblings[pi->second].push_back(cpu);
+    }
+    for (size_t i = 0; i != domains.size(); ++i) domains[i].cpus.insert(domains[i].cpus.end(), siblings[i].begin(), siblings[i].end());
+#endif
+    return domains;
+}
+
+// spreads threads that need thread_mem bytes of scratchpads each over cache domains so that scratchpads
+// of as many threads as possible fit into L3, returns cpu for every thread (empty if topology is unknown)
+// and number of threads which scratchpads fit into cache in cache_fit
+static inline std::vector<unsigned> plan_affinity(const std::vector<CacheDomain>& domains, const unsigned threads, const uint64_t thread_mem, unsigned& cache_fit) {
+    std::vector<unsigned> plan;
+    std::vector<size_t> used(domains.size(), 0);
+    cache_fit = 0;
+    if (domains.empty()) return plan;
+    for (bool placed = true; placed && plan.size() < threads; ) {
+        placed = false;
+        for (size_t i = 0; i != domains.size() && plan.size() < threads; ++i) {
+            if (used[i] == domains[i].cpus.size()) continue;
+            if (domains[i].size && (used[i] + 1) * thread_mem > domains[i].size) continue;
+            plan.push_back(domains[i].cpus[used[i]++]);
+            placed = true;
+        }
+    }
+    cache_fit = plan.size();
+    // remaining threads can not fit into L3 anyway, so just use remaining cpus and then wrap around
+    while (plan.size() < threads) {
+        bool placed = false;
+        for (size_t i = 0; i != domains.size() && plan.size() < threads; ++i) {
+            if (used[i] == domains[i].cpus.size()) continue;
+            plan.push_back(domains[i].cpus[used[i]++]);
+            placed = true;
+        }
+        if (!placed) std::fill(used.begin(), used.end(), 0);
+    }
+    return plan;
+}
+
+static inline bool set_thread_affinity(std::thread& thread, const unsigned cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+// lowers scheduling of the calling thread only (Linux nice and SCHED_IDLE policy are per thread)
+static inline bool set_thread_priority(const bool sched_idle, const int nice) {
+#if defined(__linux__)
+    if (sched_idle) {
+        struct sched_param param = {};
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) return false;
+    }
+    if (nice && setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) != 0) return false;
+    return true;
+#else
+    return !sched_idle && !nice;
+#endif
+}
+
+// sets io priority of the calling thread: best effort level 0-7 or io_priority_idle
+static inline bool set_thread_io_priority(const int io_priority) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    const int IOPRIO_WHO_PROCESS = 1, IOPRIO_CLASS_BE = 2, IOPRIO_CLASS_IDLE = 3, IOPRIO_CLASS_SHIFT = 13;
+    const int ioprio = io_priority == io_priority_idle ? IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT : (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | io_priority;
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, syscall(SYS_gettid), ioprio) == 0;
+#else
+    return false;
+#endif
+}
+
+// reads file of this process cgroup (v2 one if controller is empty, v1 controller one otherwise),
+// tries own cgroup path first and then cgroup root as it is usually seen inside containers
+static inline std::string read_cgroup(const std::string& controller, const std::string& name) {
+    std::ifstream file("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(file, line)) {
+        const size_t p1 = line.find(':');
+        const size_t p2 = p1 == std::string::npos ? p1 : line.find(':', p1 + 1);
+        if (p2 == std::string::npos) continue;
+        const std::string controllers = line.substr(p1 + 1, p2 - p1 - 1);
+        if (controller.empty() ? !controllers.empty() : ("," + controllers + ",").find("," + controller + ",") == std::string::npos) continue;
+        const std::string base = controller.empty() ? "/sys/fs/cgroup" : "/sys/fs/cgroup/" + controller;
+        std::string value = read_line(base + line.substr(p2 + 1) + "/" + name);
+        if (value.empty()) value = read_line(base + "/" + name);
+        if (!value.empty()) return value;
+    }
+    return "";
+}
+
+// number of cpus this process can use: cpu affinity mask limited by cgroup v2 cpu.max or v1 cfs quota
+static inline double available_cpus() {
+    double cpus = std::thread::hardware_concurrency();
+#if defined(__linux__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) cpus = CPU_COUNT(&set);
+    double quota = 0, period = 0;
+    const std::string cpu_max = read_cgroup("", "cpu.max");
+    if (!cpu_max.empty()) {
+        if (cpu_max.compare(0, 3, "max") != 0) {
+            char* end;
+            quota  = strtod(cpu_max.c_str(), &end);
+            period = strtod(end, nullptr);
+        }
+    } else {
+        quota  = strtod(read_cgroup("cpu", "cpu.cfs_quota_us").c_str(), nullptr);
+        period = strtod(read_cgroup("cpu", "cpu.cfs_period_us").c_str(), nullptr);
+    }
+    if (quota > 0 && period > 0 && quota / period < cpus) cpus = quota / period;
+#endif
+    return cpus;
+}
+
+// bytes of memory this process can use: physical memory limited by cgroup v2 memory.max or v1 memory limit
+static inline uint64_t available_memory() {
+    uint64_t memory = UINT64_MAX;
+#if defined(__linux__)
+    memory = static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    std::string limit = read_cgroup("", "memory.max");
+    if (limit.empty()) limit = read_cgroup("memory", "memory.limit_in_bytes");
+    if (!limit.empty() && limit != "max") memory = std::min(memory, static_cast<uint64_t>(strtoull(limit.c_str(), nullptr, 10)));
+#endif
+    return memory;
+}
+
+// aggregated jiffies of all cpus from /proc/stat (idle includes iowait)
+struct CpuTimes {
+    uint64_t idle;
+    uint64_t total;
+    CpuTimes() : idle(0), total(0) {}
+};
+
+static inline bool read_cpu_times(CpuTimes& times) {
+    const std::string line = read_line("/proc/stat");
+    if (line.compare(0, 4, "cpu ") != 0) return false;
+    const char* p = line.c_str() + 4;
+    times = CpuTimes();
+    // user nice system idle iowait irq softirq steal (guest time is already counted in user)
+    for (unsigned i = 0; i != 8; ++i) {
+        char* end;
+        const uint64_t value = strtoull(p, &end, 10);
+        if (end == p) break;
+        p = end;
+        times.total += value;
+        if (i == 3 || i == 4) times.idle += value;
+    }
+    return times.total != 0;
+}
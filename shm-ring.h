@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include "message-queue.h"
+
+// Layout of shared memory region between sickle-shm engine process and external supervisor process.
+// All fields are native endian, atomics are plain lock-free 64-bit words, so the region can be used
+// from C (stdatomic.h) or Go (sync/atomic) as well.
+
+const uint32_t shm_magic     = 0x4C4B4353; // "SCKL"
+const uint32_t shm_version   = 2;          // 2 added target, nonce and local target fields to ShmCommand
+const uint64_t shm_ring_size = 256;        // result slots, power of two
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory needs lock-free 64-bit atomics");
+
+enum ShmAction {
+    shm_action_none     = 0,
+    shm_action_job      = 1,
+    shm_action_pause    = 2, // threads field limits it to some threads
+    shm_action_throttle = 3, // uses max_usage field
+    shm_action_close    = 4
+};
+
+// optional job fields of ShmCommand (other ones are used as is)
+enum ShmJobFlags {
+    shm_job_target256    = 1, // target256 is used instead of target
+    shm_job_nonce_range  = 2, // nonce_start, nonce_end, nonce_stride and nonce_partition
+    shm_job_nonce_layout = 4  // nonce_offset and nonce_width
+};
+
+// command written by supervisor, strings should be zero terminated (longer ones are rejected)
+struct ShmCommand {
+    uint32_t action;
+    uint32_t ways;      // 0 to pick automatically
+    uint32_t soft_aes;
+    uint32_t max_usage;
+    uint32_t blob_len;
+    uint32_t flags;     // ShmJobFlags
+    uint64_t target;    // compared with top 64 bits of hash
+    uint64_t difficulty;   // replaces target if it is not 0
+    uint64_t local_target; // easier target which hits are only counted (0 to disable)
+    uint64_t nonce_start;
+    uint64_t nonce_end;    // 0 for the end of nonce space
+    uint64_t nonce_stride;
+    uint64_t nonce_partition;
+    uint32_t nonce_offset;
+    uint32_t nonce_width;
+    uint8_t  target256[hash_len]; // little endian like hash
+    char     algo[32];
+    char     job_id[max_job_id_len + 8];
+    char     threads[64];
+    uint8_t  blob[max_blob_len];
+};
+
+// control slot guarded by seqlock: supervisor makes seq odd, writes command and makes seq even again,
+// engine takes command when it sees new even seq that did not change while command was copied
+struct ShmControl {
+    std::atomic<uint64_t> seq;
+    ShmCommand            command;
+};
+
+struct ShmResultRecord {
+    uint64_t nonce;
+    uint8_t  hash[hash_len];
+    uint16_t thread;
+    uint8_t  way;
+    uint8_t  reserved[5];
+    int64_t  found_ns; // CLOCK_MONOTONIC nanoseconds
+    char     job_id[max_job_id_len + 8];
+};
+
+// slot of bounded multi producer (hashing threads) single consumer (supervisor) result ring:
+// seq is position + 1 when record at position is ready and position + shm_ring_size when slot is free again
+struct ShmResultSlot {
+    std::atomic<uint64_t> seq;
+    ShmResultRecord       record;
+};
+
+struct ShmRegion {
+    std::atomic<uint32_t> magic;           // set to shm_magic by engine after region is initialized
+    uint32_t              version;
+    std::atomic<uint64_t> heartbeat_ms;    // updated by engine about every second
+    std::atomic<uint64_t> results_dropped; // results found while ring was full
+    std::atomic<uint64_t> head;            // next result position of engine
+    std::atomic<uint64_t> tail;            // next result position of supervisor
+    ShmControl            control;
+    ShmResultSlot         results[shm_ring_size];
+};
+
+// prepares result ring for new engine, keeps control slot so that the last command is taken again
+// (engine skips it if it is close)
+static inline void shm_attach(ShmRegion& region) {
+    region.magic.store(0, std::memory_order_relaxed);
+    region.version = shm_version;
+    region.results_dropped.store(0, std::memory_order_relaxed);
+    region.head.store(0, std::memory_order_relaxed);
+    region.tail.store(0, std::memory_order_relaxed);
+    for (uint64_t i = 0; i != shm_ring_size; ++i) region.results[i].seq.store(i, std::memory_order_relaxed);
+    region.magic.store(shm_magic, std::memory_order_release);
+}
+
+// supervisor side of control slot (there must be only one writer)
+static inline void shm_write_command(ShmControl& control, const ShmCommand& command) {
+    const uint64_t seq = control.seq.load(std::memory_order_relaxed);
+    control.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&control.command, &command, sizeof(command));
+    control.seq.store(seq + 2, std::memory_order_release);
+}
+
+// engine side of control slot, returns true and updates last_seq if there is new complete command
+static inline bool shm_read_command(ShmControl& control, uint64_t& last_seq, ShmCommand& command) {
+    const uint64_t seq = control.seq.load(std::memory_order_acquire);
+    if (seq == last_seq || seq & 1) return false;
+    memcpy(&command, &control.command, sizeof(command));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (control.seq.load(std::memory_order_relaxed) != seq) return false;
+    last_seq = seq;
+    return true;
+}
+
+// engine side of result ring (safe to call from several hashing threads), returns false if ring is full
+static inline bool shm_push_result(ShmRegion& region, const Result& result) {
+    uint64_t pos = region.head.load(std::memory_order_relaxed);
+    while (true) {
+        ShmResultSlot& slot = region.results[pos & (shm_ring_size - 1)];
+        const int64_t diff = static_cast<int64_t>(slot.seq.load(std::memory_order_acquire) - pos);
+        if (diff < 0) {
+            region.results_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (diff == 0 && region.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            ShmResultRecord& record = slot.record;
+            memset(&record, 0, sizeof(record));
+            record.nonce    = result.nonce;
+            memcpy(record.hash, result.hash, hash_len);
+            record.thread   = result.thread;
+            record.way      = result.way;
+            record.found_ns = result.found_ns;
+            memcpy(record.job_id, result.job_id, sizeof(result.job_id));
+            slot.seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+        if (diff > 0) pos = region.head.load(std::memory_order_relaxed);
+    }
+}
+
+// supervisor side of result ring (there must be only one reader), returns false if ring is empty
+static inline bool shm_pop_result(ShmRegion& region, ShmResultRecord& record) {
+    const uint64_t pos = region.tail.load(std::memory_order_relaxed);
+    ShmResultSlot& slot = region.results[pos & (shm_ring_size - 1)];
+    if (slot.seq.load(std::memory_order_acquire) != pos + 1) return false;
+    memcpy(&record, &slot.record, sizeof(record));
+    slot.seq.store(pos + shm_ring_size, std::memory_order_release);
+    region.tail.store(pos + 1, std::memory_order_relaxed);
+    return true;
+}
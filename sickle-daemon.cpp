@@ -0,0 +1,365 @@
+// Headless engine front-end for boxes without Node: takes jobs and reports results and engine messages
+// over binary protocol on stdin/stdout or on Unix socket (one client at a time).
+//
+// Usage: sickle-daemon [unix:<path>] [option=value ...]
+//   options are the same as worker options: threads, affinity, idle_target, priority, io_priority, max_usage
+//
+// Frames in both directions are uint32 little endian payload length, uint8 frame type and payload.
+// Strings are prefixed by uint8 length unless said otherwise, integers are little endian.
+// To daemon:
+//   1 job:      uint8 ways (0 to pick automatically), uint8 soft_aes, uint64 target, uint64 local_target
+//               (0 to disable), algo, job_id, threads (empty for all threads), blob
+//   2 pause:    threads (empty for all threads)
+//   3 throttle: uint8 max_usage
+//   4 close
+//   5 job2:     uint8 ways, uint8 soft_aes, uint8 flags, then target: 32 bytes little endian 256-bit one
+//               if flags & 1 or uint64 one otherwise, optional fields present if their flag is set:
+//               uint64 difficulty (flags & 2, replaces target), uint64 local_target (flags & 4),
+//               uint64 nonce_start, nonce_end, nonce_stride, nonce_partition (flags & 8),
+//               uint8 nonce_offset, uint8 nonce_width (flags & 16), then algo, job_id, threads and blob
+//               (the same fields as addon sendJob takes, nonce range end is reported by "range_end" message)
+// From daemon:
+//   129 result:  uint64 nonce, 32 bytes hash, uint16 thread, uint8 way, job_id
+//   130 message: name, uint8 value count, then key and uint16 length prefixed value of every value
+//                (same messages as addon progress callback gets, like "hashrate", "threads" or "error",
+//                and "frames_dropped" with total count of frames dropped because client did not read them)
+// When Unix socket client disconnects hashing is paused until the next client sends a job.
+// Frames are written by own thread, so client that stops reading never blocks hashing threads.
+
+#include "engine.h"
+#include "native-options.h"
+#include <cstdio>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+enum DaemonFrame {
+    frame_job      = 1,
+    frame_pause    = 2,
+    frame_throttle = 3,
+    frame_close    = 4,
+    frame_job2     = 5,
+    frame_result   = 129,
+    frame_message  = 130
+};
+
+// optional fields of job2 frame
+enum DaemonJobFlags {
+    job_target256    = 1,
+    job_difficulty   = 2,
+    job_local_target = 4,
+    job_nonce_range  = 8,
+    job_nonce_layout = 16
+};
+
+const uint32_t max_frame_len     = 1024;
+const size_t   max_queued_frames = 4096; // frames waiting for client, more are dropped
+
+static bool read_all(const int fd, void* const data, const size_t size) {
+    for (size_t done = 0; done != size; ) {
+        const ssize_t part = read(fd, static_cast<char*>(data) + done, size - done);
+        if (part <= 0) return false;
+        done += part;
+    }
+    return true;
+}
+
+static bool write_all(const int fd, const void* const data, const size_t size) {
+    for (size_t done = 0; done != size; ) {
+        const ssize_t part = write(fd, static_cast<const char*>(data) + done, size - done);
+        if (part <= 0) return false;
+        done += part;
+    }
+    return true;
+}
+
+static void put_string(std::string& data, const std::string& str) {
+    const size_t size = std::min<size_t>(str.size(), 255);
+    data += static_cast<char>(size);
+    data.append(str, 0, size);
+}
+
+// reads fields of frame payload, any read past its end makes it bad
+class FrameReader {
+
+    private:
+
+        const uint8_t* m_p;
+        const uint8_t* const m_end;
+        bool m_ok;
+
+    public:
+
+        FrameReader(const uint8_t* const data, const size_t size) : m_p(data), m_end(data + size), m_ok(true) {}
+
+        bool ok() const { return m_ok; }
+
+        uint64_t le(const unsigned size) {
+            uint64_t value = 0;
+            if (static_cast<size_t>(m_end - m_p) < size) m_ok = false;
+            else for (unsigned i = 0; i != size; ++i) value |= static_cast<uint64_t>(*m_p++) << (i * 8);
+            return value;
+        }
+
+        std::string str() {
+            return bytes(le(1));
+        }
+
+        std::string bytes(const size_t size) {
+            if (static_cast<size_t>(m_end - m_p) < size) {
+                m_ok = false;
+                return "";
+            }
+            m_p += size;
+            return std::string(reinterpret_cast<const char*>(m_p - size), size);
+        }
+};
+
+class Daemon: public EngineListener {
+
+    private:
+
+        MessageQueue<Message>     m_queue;      // to engine control loop
+        MessageQueue<std::string> m_frames;     // to writer thread, empty frame stops it
+        std::atomic<uint64_t>     m_frames_dropped;
+        std::mutex                m_out_mutex;  // held by writer thread while it writes
+        int                       m_out;        // -1 while there is no client
+        std::thread               m_writer;
+
+        static std::string message_payload(const Message& msg) {
+            std::string payload;
+            put_string(payload, msg.name);
+            payload += static_cast<char>(std::min<size_t>(msg.values.size(), 255));
+            unsigned count = 0;
+            for (MessageValues::const_iterator pi = msg.values.begin(); pi != msg.values.end() && count != 255; ++ pi, ++ count) {
+                put_string(payload, pi->first);
+                const size_t size = std::min<size_t>(pi->second.size(), 0xFFFF);
+                put_le(payload, size, 2);
+                payload.append(pi->second, 0, size);
+            }
+            return payload;
+        }
+
+        static std::string frame(const uint8_t type, const std::string& payload) {
+            std::string frame;
+            put_le(frame, payload.size(), 4);
+            frame += static_cast<char>(type);
+            frame += payload;
+            return frame;
+        }
+
+        // called from any thread, never blocks on client
+        void writeFrame(const uint8_t type, const std::string& payload) {
+            if (!m_frames.write(frame(type, payload), max_queued_frames)) ++ m_frames_dropped;
+        }
+
+        // writes queued frames to client and reports drops once there is room for it again
+        void writeFrames() {
+            uint64_t reported_dropped = 0;
+            while (true) {
+                std::deque<std::string> frames;
+                m_frames.readAll(frames, std::chrono::seconds(1));
+                const uint64_t dropped = m_frames_dropped.load();
+                if (dropped != reported_dropped) {
+                    reported_dropped = dropped;
+                    MessageValues values;
+                    values["count"] = std::to_string(dropped);
+                    frames.push_back(frame(frame_message, message_payload(Message("frames_dropped", values))));
+                }
+                std::lock_guard<std::mutex> locker(m_out_mutex);
+                for (const std::string& frame : frames) {
+                    if (frame.empty()) return;
+                    if (m_out >= 0 && !write_all(m_out, frame.data(), frame.size())) m_out = -1;
+                }
+            }
+        }
+
+        void sendError(const char* const sz) {
+            MessageValues values;
+            values["message"] = sz;
+            send(Message("error", values));
+        }
+
+        // converts frame into the same message worker would get from JS, returns false for close frame
+        bool frame2message(const uint8_t type, const uint8_t* const data, const size_t size) {
+            FrameReader reader(data, size);
+            switch (type) {
+                case frame_job:
+                case frame_job2: {
+                    std::shared_ptr<JobRequest> request = std::make_shared<JobRequest>();
+                    request->ways     = reader.le(1);
+                    request->soft_aes = reader.le(1) != 0;
+                    const unsigned flags = type == frame_job ? job_local_target : reader.le(1);
+                    if (flags & ~(job_target256 | job_difficulty | job_local_target | job_nonce_range | job_nonce_layout)) break;
+                    if (flags & job_target256) {
+                        const std::string target256 = reader.bytes(hash_len);
+                        if (!reader.ok()) break;
+                        request->setTarget256(reinterpret_cast<const uint8_t*>(target256.data()));
+                    } else request->target = reader.le(8);
+                    if (flags & job_difficulty)   request->difficulty   = reader.le(8);
+                    if (flags & job_local_target) request->local_target = reader.le(8);
+                    if (flags & job_nonce_range) {
+                        request->nonce_start     = reader.le(8);
+                        request->nonce_end       = reader.le(8);
+                        request->nonce_stride    = reader.le(8);
+                        request->nonce_partition = reader.le(8);
+                    }
+                    if (flags & job_nonce_layout) {
+                        const unsigned nonce_offset = reader.le(1);
+                        const unsigned nonce_width  = reader.le(1);
+                        if (!request->setNonceLayout(nonce_offset, nonce_width)) break;
+                    }
+                    request->algo    = reader.str();
+                    request->job_id  = reader.str();
+                    request->threads = reader.str();
+                    const std::string blob = reader.str();
+                    if (!reader.ok() || !request->setBlob(blob.data(), blob.size())) break;
+                    m_queue.write(Message("job", MessageValues(), request));
+                    return true;
+                }
+                case frame_pause: {
+                    MessageValues values;
+                    values["threads"] = reader.str();
+                    if (!reader.ok()) break;
+                    m_queue.write(Message("pause", values));
+                    return true;
+                }
+                case frame_throttle: {
+                    MessageValues values;
+                    values["max_usage"] = std::to_string(reader.le(1));
+                    if (!reader.ok()) break;
+                    m_queue.write(Message("throttle", values));
+                    return true;
+                }
+                case frame_close:
+                    m_queue.write(Message("close", MessageValues()));
+                    return false;
+            }
+            sendError("Bad frame");
+            return true;
+        }
+
+        // reads frames of one client until it disconnects or sends close frame, returns false in the latter case
+        bool serve(const int in) {
+            while (true) {
+                uint8_t header[5];
+                if (!read_all(in, header, sizeof(header))) return true;
+                const uint32_t size = header[0] | header[1] << 8 | header[2] << 16 | static_cast<uint32_t>(header[3]) << 24;
+                if (size > max_frame_len) {
+                    sendError("Too long frame");
+                    return true;
+                }
+                uint8_t data[max_frame_len];
+                if (!read_all(in, data, size)) return true;
+                if (!frame2message(header[4], data, size)) return false;
+            }
+        }
+
+    public:
+
+        Daemon() : m_frames_dropped(0), m_out(-1), m_writer(&Daemon::writeFrames, this) {}
+
+        // writes frames that are still queued
+        ~Daemon() {
+            m_frames.write(std::string());
+            m_writer.join();
+        }
+
+        void send(const Message& msg) {
+            writeFrame(frame_message, message_payload(msg));
+        }
+
+        void send(const Result& result) {
+            std::string payload;
+            put_le(payload, result.nonce, 8);
+            payload.append(reinterpret_cast<const char*>(result.hash), hash_len);
+            put_le(payload, result.thread, 2);
+            payload += static_cast<char>(result.way);
+            put_string(payload, result.job_id);
+            writeFrame(frame_result, payload);
+        }
+
+        // stdin/stdout mode, end of input closes daemon
+        void serveStdio() {
+            {   std::lock_guard<std::mutex> locker(m_out_mutex);
+                m_out = STDOUT_FILENO;
+            }
+            if (serve(STDIN_FILENO)) m_queue.write(Message("close", MessageValues()));
+        }
+
+        // Unix socket mode, serves clients one by one until one of them sends close frame
+        void serveSocket(const int listen_fd) {
+            while (true) {
+                const int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) continue;
+                {   std::lock_guard<std::mutex> locker(m_out_mutex);
+                    m_out = fd;
+                }
+                const bool more = serve(fd);
+                // unblocks writer thread if it waits for client that stopped reading
+                shutdown(fd, SHUT_RDWR);
+                {   std::lock_guard<std::mutex> locker(m_out_mutex);
+                    m_out = -1;
+                }
+                close(fd);
+                if (!more) return;
+                // nobody would get results of the current job
+                m_queue.write(Message("pause", MessageValues()));
+            }
+        }
+
+        // engine control loop, the same as addon worker one
+        void run(const EngineOptions& options) {
+            Engine engine(*this, options);
+            while (true) {
+                std::deque<Message> messages;
+                m_queue.readAll(messages, std::chrono::seconds(1));
+                for (std::deque<Message>::const_iterator pi = messages.begin(); pi != messages.end(); ++ pi) {
+                    if (pi->name == "close") return;
+                    engine.onMessage(*pi);
+                }
+                engine.tick();
+            }
+        }
+};
+
+static int listen_unix(const std::string& path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(const int argc, const char* const argv[]) {
+    const bool unix_socket = argc > 1 && strncmp(argv[1], "unix:", 5) == 0;
+    const MessageValues options = parse_options(argc, argv, unix_socket ? 2 : 1);
+    // client disconnect should not kill daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    Daemon daemon;
+    if (unix_socket) {
+        const std::string path = argv[1] + 5;
+        const int listen_fd = listen_unix(path);
+        if (listen_fd < 0) {
+            perror(path.c_str());
+            return 1;
+        }
+        std::thread([&daemon, listen_fd]() { daemon.serveSocket(listen_fd); }).detach();
+        daemon.run(engine_options(options));
+        close(listen_fd);
+        unlink(path.c_str());
+    } else {
+        std::thread([&daemon]() { daemon.serveStdio(); }).detach();
+        daemon.run(engine_options(options));
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+// Engine front-end for non-JS supervisors: takes commands from and puts results into shared memory
+// region (see shm-ring.h) instead of exchanging messages with Node.
+//
+// Usage: sickle-shm <name|fd:N> [option=value ...]
+//   name   - POSIX shared memory object (/dev/shm/name), created if it does not exist
+//   fd:N   - already opened file descriptor (like memfd) inherited from supervisor
+//   options are the same as worker options: threads, affinity, idle_target, priority, io_priority, max_usage
+// Other engine messages (errors, hashrate with local_hits, threads, ways, range_end) are printed to stdout
+// as "name key=value ..." lines.
+
+#include "engine.h"
+#include "shm-ring.h"
+#include "native-options.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+class ShmFrontend: public EngineListener {
+
+    private:
+
+        ShmRegion& m_region;
+        std::mutex m_stdout_mutex;
+
+    public:
+
+        explicit ShmFrontend(ShmRegion& region) : m_region(region) {}
+
+        void send(const Message& msg) {
+            std::string line = msg.name;
+            for (MessageValues::const_iterator pi = msg.values.begin(); pi != msg.values.end(); ++ pi) line += " " + pi->first + "=" + pi->second;
+            std::lock_guard<std::mutex> locker(m_stdout_mutex);
+            printf("%s\n", line.c_str());
+            fflush(stdout);
+        }
+
+        void send(const Result& result) {
+            shm_push_result(m_region, result);
+        }
+};
+
+// returns false if str is not zero terminated within size chars
+static bool fixed_string(const char* const str, const size_t size, std::string& result) {
+    const size_t len = strnlen(str, size);
+    result.assign(str, len);
+    return len != size;
+}
+
+static Message error_message(const char* const sz) {
+    MessageValues values;
+    values["message"] = sz;
+    return Message("error", values);
+}
+
+// converts shm command into the same message worker would get from JS (or into error message for bad one),
+// returns false for close command
+static bool command2message(const ShmCommand& command, Message& msg) {
+    switch (command.action) {
+        case shm_action_job: {
+            std::shared_ptr<JobRequest> request = std::make_shared<JobRequest>();
+            if (!fixed_string(command.algo, sizeof(command.algo), request->algo) ||
+                !fixed_string(command.threads, sizeof(command.threads), request->threads)) {
+                msg = error_message("Bad job string");
+                return true;
+            }
+            // longer ids are rejected by engine with its own error
+            fixed_string(command.job_id, sizeof(command.job_id), request->job_id);
+            if (!request->setBlob(command.blob, command.blob_len)) {
+                msg = error_message("Bad blob length");
+                return true;
+            }
+            if (command.flags & shm_job_nonce_layout && !request->setNonceLayout(command.nonce_offset, command.nonce_width)) {
+                msg = error_message("Bad nonce layout");
+                return true;
+            }
+            if (command.flags & shm_job_target256) request->setTarget256(command.target256);
+            else request->target = command.target;
+            if (command.flags & shm_job_nonce_range) {
+                request->nonce_start     = command.nonce_start;
+                request->nonce_end       = command.nonce_end;
+                request->nonce_stride    = command.nonce_stride;
+                request->nonce_partition = command.nonce_partition;
+            }
+            request->soft_aes     = command.soft_aes != 0;
+            request->ways         = command.ways;
+            request->difficulty   = command.difficulty;
+            request->local_target = command.local_target;
+            msg = Message("job", MessageValues(), request);
+            return true;
+        }
+        case shm_action_pause: {
+            MessageValues values;
+            if (!fixed_string(command.threads, sizeof(command.threads), values["threads"])) {
+                msg = error_message("Bad job string");
+                return true;
+            }
+            msg = Message("pause", values);
+            return true;
+        }
+        case shm_action_throttle: {
+            MessageValues values;
+            values["max_usage"] = std::to_string(command.max_usage);
+            msg = Message("throttle", values);
+            return true;
+        }
+        case shm_action_close:
+            return false;
+        default:
+            msg = Message("", MessageValues());
+            return true;
+    }
+}
+
+// runs engine until close command
+static void run(ShmRegion& region, const MessageValues& options) {
+    ShmFrontend frontend(region);
+    Engine engine(frontend, engine_options(options));
+    uint64_t last_seq = 0;
+    // the last command is taken again by restarted engine, but close in it was meant for the previous one
+    const uint64_t start_seq = region.control.seq.load(std::memory_order_acquire);
+    std::chrono::steady_clock::time_point tick_time;
+    while (true) {
+        ShmCommand command;
+        if (shm_read_command(region.control, last_seq, command)) {
+            Message msg("", MessageValues());
+            if (!command2message(command, msg)) {
+                if (last_seq != start_seq) return;
+            } else if (msg.name == "error") frontend.send(msg);
+            else engine.onMessage(msg);
+        }
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now - tick_time >= std::chrono::seconds(1)) {
+            engine.tick();
+            region.heartbeat_ms.store(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count(), std::memory_order_relaxed);
+            tick_time = now;
+        }
+        // commands are polled, so they are taken at most about a millisecond after they are written
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+int main(const int argc, const char* const argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <name|fd:N> [option=value ...]\n", argv[0]);
+        return 1;
+    }
+
+    const MessageValues options = parse_options(argc, argv, 2);
+    const std::string name = argv[1];
+    const int fd = name.compare(0, 3, "fd:") == 0 ? atoi(name.c_str() + 3) : shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (static_cast<size_t>(st.st_size) < sizeof(ShmRegion) && ftruncate(fd, sizeof(ShmRegion)) != 0)) {
+        perror(name.c_str());
+        return 1;
+    }
+    void* const memory = mmap(nullptr, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    ShmRegion& region = *static_cast<ShmRegion*>(memory);
+    shm_attach(region);
+    run(region, options);
+
+    munmap(memory, sizeof(ShmRegion));
+    close(fd);
+    return 0;
+}
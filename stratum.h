@@ -0,0 +1,554 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "engine.h"
+
+#if defined(_WIN32)
+#error Native stratum client needs POSIX sockets
+#endif
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+// just enough JSON for stratum messages
+struct JsonValue {
+    enum Type { null_type, bool_type, number_type, string_type, array_type, object_type };
+
+    Type                             type;
+    bool                             boolean;
+    double                           number;
+    std::string                      str;
+    std::vector<JsonValue>           items;
+    std::map<std::string, JsonValue> fields;
+
+    JsonValue() : type(null_type), boolean(false), number(0) {}
+
+    // field of object or null value if there is no such field
+    const JsonValue& operator[](const std::string& name) const {
+        static const JsonValue null_value;
+        const std::map<std::string, JsonValue>::const_iterator pi = fields.find(name);
+        return pi == fields.end() ? null_value : pi->second;
+    }
+
+    bool isNull() const { return type == null_type; }
+};
+
+static inline void json_skip_ws(const char*& p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') ++p;
+}
+
+static inline bool json_parse_string(const char*& p, std::string& str) {
+    if (*p++ != '"') return false;
+    str.clear();
+    while (*p != '"') {
+        if (!*p) return false;
+        if (*p != '\\') {
+            str += *p++;
+            continue;
+        }
+        switch (*++p) {
+            case '"': case '\\': case '/': str += *p; break;
+            case 'b': str += '\b'; break;
+            case 'f': str += '\f'; break;
+            case 'n': str += '\n'; break;
+            case 'r': str += '\r'; break;
+            case 't': str += '\t'; break;
+            case 'u': {
+                char* end;
+                const std::string hex(p + 1, strnlen(p + 1, 4));
+                const unsigned code = strtoul(hex.c_str(), &end, 16);
+                if (hex.size() != 4 || *end) return false;
+                // UTF-8 of basic multilingual plane code point (surrogate pairs are not joined)
+                if (code < 0x80) str += static_cast<char>(code);
+                else if (code < 0x800) {
+                    str += static_cast<char>(0xC0 | (code >> 6));
+                    str += static_cast<char>(0x80 | (code & 0x3F));
+                } else {
+                    str += static_cast<char>(0xE0 | (code >> 12));
+                    str += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                    str += static_cast<char>(0x80 | (code & 0x3F));
+                }
+                p += 4;
+                break;
+            }
+            default: return false;
+        }
+        ++p;
+    }
+    ++p;
+    return true;
+}
+
+// deeper values are rejected, so that hostile input can not exhaust the stack
+const unsigned json_max_depth = 32;
+
+static inline bool json_parse(const char*& p, JsonValue& value, const unsigned depth = 0) {
+    json_skip_ws(p);
+    value = JsonValue();
+    if ((*p == '{' || *p == '[') && depth == json_max_depth) return false;
+    if (*p == '{') {
+        value.type = JsonValue::object_type;
+        json_skip_ws(++p);
+        if (*p == '}') {
+            ++p;
+            return true;
+        }
+        while (true) {
+            std::string name;
+            json_skip_ws(p);
+            if (!json_parse_string(p, name)) return false;
+            json_skip_ws(p);
+            if (*p++ != ':' || !json_parse(p, value.fields[name], depth + 1)) return false;
+            json_skip_ws(p);
+            if (*p == '}') {
+                ++p;
+                return true;
+            }
+            if (*p++ != ',') return false;
+        }
+    } else if (*p == '[') {
+        value.type = JsonValue::array_type;
+        json_skip_ws(++p);
+        if (*p == ']') {
+            ++p;
+            return true;
+        }
+        while (true) {
+            value.items.push_back(JsonValue());
+            if (!json_parse(p, value.items.back(), depth + 1)) return false;
+            json_skip_ws(p);
+            if (*p == ']') {
+                ++p;
+                return true;
+            }
+            if (*p++ != ',') return false;
+        }
+    } else if (*p == '"') {
+        value.type = JsonValue::string_type;
+        return json_parse_string(p, value.str);
+    } else if (strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0) {
+        value.type    = JsonValue::bool_type;
+        value.boolean = *p == 't';
+        p += value.boolean ? 4 : 5;
+        return true;
+    } else if (strncmp(p, "null", 4) == 0) {
+        p += 4;
+        return true;
+    } else {
+        char* end;
+        value.type   = JsonValue::number_type;
+        value.number = strtod(p, &end);
+        if (end == p) return false;
+        p = end;
+        return true;
+    }
+}
+
+static inline std::string json_string(const std::string& str) {
+    std::string json = "\"";
+    for (const char c : str) {
+        if (c == '"' || c == '\\') json += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            json += esc;
+        } else json += c;
+    }
+    return json + "\"";
+}
+
+struct StratumOptions {
+    std::string host;
+    std::string port;
+    std::string login;
+    std::string pass;
+    std::string rig_id;
+    std::string algo;         // used if pool job does not specify one
+    std::string soft_aes;
+    std::string ways;
+    std::string threads;      // engine threads for pool jobs, empty for all threads
+    std::string local_target; // hex target which hits are only counted locally, empty to disable
+};
+
+// Stratum (JSON-RPC over TCP) client that feeds pool jobs into engine control loop queue directly
+// and queues shares found for them by hashing threads to its own thread, so event loop is not in share
+// critical path and slow pool never blocks hashing. It reports "stratum" (connection status and new jobs)
+// and "share" (pool answer) events to listener, as well as "shares_dropped" with total count of shares
+// that could not be submitted (no pool login or too many queued).
+class StratumClient {
+
+    private:
+
+        static const unsigned m_max_job_ids     = 16;          // recent pool jobs shares are still submitted for
+        static const unsigned m_max_outbox      = 256;         // queued submits, more are dropped
+        static const int      m_io_timeout_ms   = 10*1000;     // for connect and for sending one line
+        static const int      m_keepalive_ms    = 60*1000;     // pool silence after which keepalived request is sent
+        static const int      m_idle_timeout_ms = 3*60*1000;   // pool silence after which connection is dropped
+
+        EngineListener&                 m_listener;
+        MessageQueue<Message>&          m_engine;
+        const StratumOptions            m_options;
+        int                             m_socket;       // used by stratum thread only
+        int                             m_wake[2];      // pipe that wakes stratum thread up on new submit or stop
+        std::mutex                      m_mutex;        // guards fields below
+        bool                            m_connected;
+        std::string                     m_worker_id;
+        std::deque<std::string>         m_job_ids;
+        std::deque<std::string>         m_outbox;       // submit lines for stratum thread to send
+        std::map<uint64_t, std::string> m_submits;      // request id to job id of pending shares
+        uint64_t                        m_request_id;
+        uint64_t                        m_accepted;
+        uint64_t                        m_rejected;
+        uint64_t                        m_shares_dropped;
+        uint64_t                        m_reported_dropped; // used by stratum thread only
+        std::atomic<bool>               m_stop;
+        std::thread                     m_thread;
+
+        void event(const char* const name, MessageValues values) {
+            values["pool"] = m_options.host + ":" + m_options.port;
+            m_listener.send(Message(name, values));
+        }
+
+        void status(const char* const status, const std::string& message = "") {
+            MessageValues values;
+            values["status"] = status;
+            if (!message.empty()) values["message"] = message;
+            event("stratum", values);
+        }
+
+        void wake() {
+            const char byte = 0;
+            if (write(m_wake[1], &byte, 1) < 0) {} // pipe that is already full wakes up anyway
+        }
+
+        // waits up to timeout_ms for fd events (fd may be -1) or wake up, returns revents of fd
+        short waitFor(const int fd, const short events, const int timeout_ms) {
+            struct pollfd fds[2] = { { m_wake[0], POLLIN, 0 }, { fd, events, 0 } };
+            if (poll(fds, fd >= 0 ? 2 : 1, timeout_ms) <= 0) return 0;
+            if (fds[0].revents) {
+                char data[64];
+                while (read(m_wake[0], data, sizeof(data)) > 0);
+            }
+            return fd >= 0 ? fds[1].revents : 0;
+        }
+
+        // socket is non-blocking, so slow pool can only delay stratum thread for m_io_timeout_ms
+        bool sendLine(const std::string& line) {
+            const std::string data = line + "\n";
+            const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_io_timeout_ms);
+            for (size_t sent = 0; sent != data.size(); ) {
+                const ssize_t size = ::send(m_socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                if (size > 0) {
+                    sent += size;
+                    continue;
+                }
+                if (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+                const int64_t left_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                if (m_stop || left_ms <= 0) return false;
+                waitFor(m_socket, POLLOUT, left_ms);
+            }
+            return true;
+        }
+
+        // resolves pool host on its own detached thread, so that stop does not wait for slow DNS
+        // (abandoned lookup frees its result itself), returns nullptr on failure or stop
+        struct addrinfo* resolve() {
+            struct Lookup {
+                std::mutex              mutex;
+                std::condition_variable cond;
+                bool                    done = false;
+                bool                    abandoned = false;
+                struct addrinfo*        addrs = nullptr;
+            };
+            const std::shared_ptr<Lookup> lookup = std::make_shared<Lookup>();
+            const std::string host = m_options.host, port = m_options.port;
+            std::thread([lookup, host, port]() {
+                struct addrinfo hints = {};
+                hints.ai_family   = AF_UNSPEC;
+                hints.ai_socktype = SOCK_STREAM;
+                struct addrinfo* addrs = nullptr;
+                if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) addrs = nullptr;
+                std::lock_guard<std::mutex> locker(lookup->mutex);
+                if (!lookup->abandoned) lookup->addrs = addrs;
+                else if (addrs) freeaddrinfo(addrs);
+                lookup->done = true;
+                lookup->cond.notify_all();
+            }).detach();
+            std::unique_lock<std::mutex> locker(lookup->mutex);
+            while (!lookup->done && !m_stop) lookup->cond.wait_for(locker, std::chrono::milliseconds(100));
+            if (!lookup->done) lookup->abandoned = true;
+            return lookup->done ? lookup->addrs : nullptr;
+        }
+
+        // connects non-blocking socket with m_io_timeout_ms timeout (stop interrupts it)
+        int connectSocket() {
+            struct addrinfo* const addrs = resolve();
+            if (!addrs) return -1;
+            int fd = -1;
+            for (struct addrinfo* addr = addrs; addr && fd < 0 && !m_stop; addr = addr->ai_next) {
+                fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+                if (fd < 0) continue;
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                // lets kernel notice dead peer of idle connection too
+                const int keepalive = 1;
+                setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+                if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+                int error = errno;
+                if (error == EINPROGRESS) {
+                    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_io_timeout_ms);
+                    while (!m_stop && std::chrono::steady_clock::now() < deadline) {
+                        const int64_t left_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                        if (waitFor(fd, POLLOUT, left_ms)) break;
+                    }
+                    socklen_t size = sizeof(error);
+                    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0) error = errno;
+                    // still connecting after timeout
+                    if (!error && !(waitFor(fd, POLLOUT, 0) & POLLOUT)) error = ETIMEDOUT;
+                }
+                if (error) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(addrs);
+            if (fd >= 0 && m_stop) {
+                close(fd);
+                fd = -1;
+            }
+            return fd;
+        }
+
+        // reports shares dropped since the last report
+        void reportDropped() {
+            uint64_t dropped;
+            {   std::lock_guard<std::mutex> locker(m_mutex);
+                dropped = m_shares_dropped;
+            }
+            if (dropped == m_reported_dropped) return;
+            m_reported_dropped = dropped;
+            MessageValues values;
+            values["count"] = std::to_string(dropped);
+            event("shares_dropped", values);
+        }
+
+        // sends queued submits
+        bool flushOutbox() {
+            std::deque<std::string> lines;
+            {   std::lock_guard<std::mutex> locker(m_mutex);
+                lines.swap(m_outbox);
+            }
+            for (const std::string& line : lines) if (!sendLine(line)) return false;
+            return true;
+        }
+
+        void onJob(const JsonValue& job) {
+            const std::string job_id = job["job_id"].str;
+            MessageValues values;
+            values["algo"]     = job["algo"].isNull() ? m_options.algo : job["algo"].str;
+            values["soft_aes"] = m_options.soft_aes;
+            values["ways"]     = m_options.ways;
+            values["blob_hex"] = job["blob"].str;
+            values["target"]   = job["target"].str;
+            values["job_id"]   = job_id;
+            if (!m_options.threads.empty()) values["threads"] = m_options.threads;
+            if (!m_options.local_target.empty()) values["local_target"] = m_options.local_target;
+            {   std::lock_guard<std::mutex> locker(m_mutex);
+                m_job_ids.push_back(job_id);
+                if (m_job_ids.size() > m_max_job_ids) m_job_ids.pop_front();
+            }
+            m_engine.write(Message("job", values));
+            MessageValues event_values;
+            event_values["status"] = "job";
+            event_values["job_id"] = job_id;
+            event_values["algo"]   = values["algo"];
+            event_values["target"] = values["target"];
+            event("stratum", event_values);
+        }
+
+        // returns false if connection should be dropped
+        bool onLine(const std::string& line) {
+            JsonValue msg;
+            const char* p = line.c_str();
+            if (!json_parse(p, msg) || msg.type != JsonValue::object_type) {
+                status("error", "Bad pool message: " + line);
+                return true;
+            }
+            if (msg["method"].str == "job") {
+                onJob(msg["params"]);
+                return true;
+            }
+            const JsonValue& error = msg["error"];
+            const std::string error_message = error.isNull() ? "" : error["message"].str.empty() ? "error" : error["message"].str;
+            if (msg["id"].number == 1) { // login
+                if (!error_message.empty()) {
+                    // nothing else is going to come from this connection, so it is retried after reconnect delay
+                    MessageValues values;
+                    values["message"] = "Pool login failed: " + error_message;
+                    event("error", values);
+                    return false;
+                }
+                {   std::lock_guard<std::mutex> locker(m_mutex);
+                    m_worker_id = msg["result"]["id"].str;
+                }
+                status("login");
+                if (msg["result"]["job"].type == JsonValue::object_type) onJob(msg["result"]["job"]);
+                return true;
+            }
+            std::string job_id;
+            MessageValues values;
+            {   std::lock_guard<std::mutex> locker(m_mutex);
+                const std::map<uint64_t, std::string>::iterator pi = m_submits.find(static_cast<uint64_t>(msg["id"].number));
+                if (pi == m_submits.end()) return true;
+                job_id = pi->second;
+                m_submits.erase(pi);
+                ++ (error_message.empty() ? m_accepted : m_rejected);
+                values["accepted"] = std::to_string(m_accepted);
+                values["rejected"] = std::to_string(m_rejected);
+            }
+            values["job_id"] = job_id;
+            values["status"] = error_message.empty() ? "accepted" : "rejected";
+            if (!error_message.empty()) values["message"] = error_message;
+            event("share", values);
+            return true;
+        }
+
+        // asks pool to answer, so that half-open connection is noticed by idle timeout
+        bool keepalive() {
+            std::string line;
+            {   std::lock_guard<std::mutex> locker(m_mutex);
+                if (m_worker_id.empty()) return true;
+                line = "{\"id\":" + std::to_string(++ m_request_id) + ",\"jsonrpc\":\"2.0\",\"method\":\"keepalived\",\"params\":{\"id\":" +
+                       json_string(m_worker_id) + "}}";
+            }
+            return sendLine(line);
+        }
+
+        // reads pool messages and sends queued submits until connection is closed or pool is silent for too long
+        void session() {
+            {   std::lock_guard<std::mutex> locker(m_mutex);
+                m_worker_id.clear();
+                m_submits.clear();
+                m_outbox.clear();
+                m_request_id = 1;
+                m_connected  = true;
+            }
+            std::string login = "{\"id\":1,\"jsonrpc\":\"2.0\",\"method\":\"login\",\"params\":{\"login\":" + json_string(m_options.login) +
+                                ",\"pass\":" + json_string(m_options.pass) + ",\"agent\":\"sickle-core\"";
+            if (!m_options.rig_id.empty()) login += ",\"rigid\":" + json_string(m_options.rig_id);
+            if (!sendLine(login + "}}")) return;
+            std::string buffer;
+            char data[4096];
+            std::chrono::steady_clock::time_point received_time = std::chrono::steady_clock::now();
+            bool keepalive_sent = false;
+            while (!m_stop) {
+                const int64_t idle_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - received_time).count();
+                if (idle_ms >= m_idle_timeout_ms) {
+                    status("error", "Pool timeout");
+                    return;
+                }
+                if (idle_ms >= m_keepalive_ms && !keepalive_sent) {
+                    if (!keepalive()) return;
+                    keepalive_sent = true;
+                }
+                const short revents = waitFor(m_socket, POLLIN, (keepalive_sent ? m_idle_timeout_ms : m_keepalive_ms) - idle_ms);
+                if (!flushOutbox()) return;
+                reportDropped();
+                if (!revents) continue;
+                const ssize_t size = recv(m_socket, data, sizeof(data), 0);
+                if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+                if (size <= 0) return;
+                received_time  = std::chrono::steady_clock::now();
+                keepalive_sent = false;
+                buffer.append(data, size);
+                for (size_t eol; (eol = buffer.find('\n')) != std::string::npos; buffer.erase(0, eol + 1)) {
+                    if (eol && !onLine(buffer.substr(0, eol))) return;
+                }
+                if (buffer.size() > 64*1024) {
+                    status("error", "Too long pool message");
+                    return;
+                }
+            }
+        }
+
+        void run() {
+            while (!m_stop) {
+                m_socket = connectSocket();
+                if (m_socket >= 0) {
+                    status("connected");
+                    session();
+                    {   std::lock_guard<std::mutex> locker(m_mutex);
+                        m_connected = false;
+                        m_job_ids.clear();
+                        m_shares_dropped += m_outbox.size();
+                        m_outbox.clear();
+                    }
+                    close(m_socket);
+                    m_socket = -1;
+                    // pool jobs are stale now
+                    MessageValues values;
+                    if (!m_options.threads.empty()) values["threads"] = m_options.threads;
+                    m_engine.write(Message("pause", values));
+                }
+                if (m_stop) return;
+                status("disconnected");
+                const std::chrono::steady_clock::time_point reconnect_time = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+                while (!m_stop && std::chrono::steady_clock::now() < reconnect_time) {
+                    reportDropped();
+                    waitFor(-1, 0, std::chrono::duration_cast<std::chrono::milliseconds>(reconnect_time - std::chrono::steady_clock::now()).count() + 1);
+                }
+            }
+        }
+
+    public:
+
+        StratumClient(EngineListener& listener, MessageQueue<Message>& engine, const StratumOptions& options)
+            : m_listener(listener), m_engine(engine), m_options(options), m_socket(-1), m_wake(), m_connected(false), m_request_id(1), m_accepted(0), m_rejected(0),
+              m_shares_dropped(0), m_reported_dropped(0), m_stop(false)
+            {
+                if (pipe(m_wake) != 0) m_wake[0] = m_wake[1] = -1;
+                for (const int fd : m_wake) if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                m_thread = std::thread(&StratumClient::run, this);
+            }
+
+        // stop wakes stratum thread up from any wait, so this does not wait for pool (or DNS for more than 100ms)
+        ~StratumClient() {
+            m_stop = true;
+            wake();
+            m_thread.join();
+            for (const int fd : m_wake) if (fd >= 0) close(fd);
+        }
+
+        // queues share from hashing thread for stratum thread, returns false if result is not for one of pool jobs
+        // (shares that can not be queued are counted and reported by stratum thread)
+        bool submit(const Result& result) {
+            std::lock_guard<std::mutex> locker(m_mutex);
+            if (std::find(m_job_ids.begin(), m_job_ids.end(), result.job_id) == m_job_ids.end()) return false;
+            if (!m_connected || m_worker_id.empty() || m_outbox.size() >= m_max_outbox) {
+                ++ m_shares_dropped;
+                wake();
+                return true;
+            }
+            const uint64_t id = ++ m_request_id;
+            uint8_t nonce[sizeof(uint32_t)];
+            put_le(nonce, result.nonce, sizeof(nonce));
+            m_submits[id] = result.job_id;
+            m_outbox.push_back("{\"id\":" + std::to_string(id) + ",\"jsonrpc\":\"2.0\",\"method\":\"submit\",\"params\":{\"id\":" + json_string(m_worker_id) +
+                               ",\"job_id\":" + json_string(result.job_id) + ",\"nonce\":\"" + to_hex(nonce, sizeof(nonce)) +
+                               "\",\"result\":\"" + to_hex(result.hash, hash_len) + "\"}}");
+            wake();
+            return true;
+        }
+};
@@ -0,0 +1,111 @@
+// Local mock stratum pool to test native stratum client (stratum.h) without a real pool.
+//
+// Usage: node tools/mock-pool.js [port] [option=value ...]
+//   port       - TCP port to listen on 127.0.0.1 (3333 by default)
+//   algo       - algo of pool jobs (cn/1 by default)
+//   target     - 32-bit hex pool target (ffffff7f by default, so that about every other hash is a share)
+//   job_every  - accepted shares after which a new job is sent (3 by default, 0 to never send one)
+//   drop_after - shares after which connection is closed to test reconnect (0 by default to never close)
+//
+// Then start the client from the addon worker with
+//   worker.sendToCpp("stratum", { host: "127.0.0.1", port: "3333", login: "test" })
+// and watch "stratum" and "share" events. Shares are accepted if their hash meets the job target
+// (hash itself is not recomputed) and their job id is known, so a broken share path shows up as rejects.
+
+"use strict";
+
+const net = require("net");
+
+const args    = process.argv.slice(2);
+const port    = args.length && args[0].indexOf("=") < 0 ? parseInt(args.shift()) : 3333;
+const options = { algo: "cn/1", target: "ffffff7f", job_every: "3", drop_after: "0" };
+for (const arg of args) {
+    const eq = arg.indexOf("=");
+    if (eq > 0) options[arg.substr(0, eq)] = arg.substr(eq + 1);
+}
+
+let job_seq = 0;
+
+function new_job() {
+    ++ job_seq;
+    // 76 byte blob with zero nonce at offset 39 and job number in the first bytes
+    const blob = Buffer.alloc(76, 0x11);
+    blob.writeUInt32LE(job_seq, 0);
+    blob.writeUInt32LE(0, 39);
+    return { blob: blob.toString("hex"), job_id: "job" + job_seq, target: options.target, algo: options.algo };
+}
+
+// the top 32 bits of little endian hash compared with little endian 32-bit target
+function meets_target(hash_hex, target_hex) {
+    const hash   = Buffer.from(hash_hex, "hex");
+    const target = Buffer.from(target_hex, "hex");
+    return hash.length == 32 && target.length == 4 && hash.readUInt32LE(28) <= target.readUInt32LE(0);
+}
+
+net.createServer(function(socket) {
+    const peer = socket.remoteAddress + ":" + socket.remotePort;
+    const jobs = {};
+    let shares = 0, accepted = 0, buffer = "";
+    console.log(peer + " connected");
+
+    function send(msg) {
+        socket.write(JSON.stringify(msg) + "\n");
+    }
+
+    function reply(id, error, result) {
+        send({ id: id, jsonrpc: "2.0", error: error ? { code: -1, message: error } : null, result: error ? null : result });
+    }
+
+    function add_job() {
+        const job = new_job();
+        jobs[job.job_id] = job;
+        return job;
+    }
+
+    function on_message(msg) {
+        switch (msg.method) {
+            case "login":
+                console.log(peer + " login " + JSON.stringify(msg.params));
+                return reply(msg.id, null, { id: "worker1", status: "OK", job: add_job() });
+            case "submit": {
+                const params = msg.params || {};
+                const job    = jobs[params.job_id];
+                ++ shares;
+                let error = null;
+                if (params.id != "worker1") error = "Unauthenticated";
+                else if (!job) error = "Unknown job id";
+                else if (!/^[0-9a-f]{8}$/.test(params.nonce || "")) error = "Bad nonce";
+                else if (!meets_target(params.result || "", job.target)) error = "Low difficulty share";
+                console.log(peer + " share " + params.job_id + " nonce " + params.nonce + " " + (error || "accepted"));
+                reply(msg.id, error, { status: "OK" });
+                if (!error && ++ accepted % parseInt(options.job_every) == 0) send({ jsonrpc: "2.0", method: "job", params: add_job() });
+                if (parseInt(options.drop_after) && shares == parseInt(options.drop_after)) socket.destroy();
+                return;
+            }
+            case "keepalived":
+                return reply(msg.id, null, { status: "KEEPALIVED" });
+            default:
+                return reply(msg.id, "Unknown method", null);
+        }
+    }
+
+    socket.setEncoding("utf8");
+    socket.on("data", function(data) {
+        buffer += data;
+        for (let eol; (eol = buffer.indexOf("\n")) >= 0; buffer = buffer.substr(eol + 1)) {
+            const line = buffer.substr(0, eol);
+            if (!line) continue;
+            try {
+                on_message(JSON.parse(line));
+            } catch (err) {
+                console.log(peer + " bad message: " + line);
+            }
+        }
+    });
+    socket.on("close", function() {
+        console.log(peer + " disconnected after " + shares + " shares (" + accepted + " accepted)");
+    });
+    socket.on("error", function() {});
+}).listen(port, "127.0.0.1", function() {
+    console.log("mock pool listening on 127.0.0.1:" + port);
+});
@@ -28,12 +28,22 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <atomic>
 
 
 struct cryptonight_ctx {
     alignas(16) uint8_t state[200];
     alignas(16) uint8_t* memory;
+    const std::atomic<uint32_t>* epoch; // if set (in ctx[0]) hash is abandoned once *epoch differs from start_epoch
+    uint32_t start_epoch;
 };
 
 
+// checked every CN_ABORT_CHECK_MASK + 1 main loop iterations, so job switch does not wait for hash to finish
+// (output is left undefined in this case)
+#define CN_ABORT_CHECK_MASK 0x1FFF
+#define CN_ABORTED(i) \
+    (((i) & CN_ABORT_CHECK_MASK) == 0 && ctx[0]->epoch && ctx[0]->epoch->load(std::memory_order_relaxed) != ctx[0]->start_epoch)
+
+
 #endif /* __CRYPTONIGHT_H__ */
@@ -449,6 +449,8 @@ inline void cryptonight_single_hash(const uint8_t *__restrict__ input, size_t si
     uint64_t idx0 = h0[0] ^ h0[4];
 
     for (size_t i = 0; i < ITERATIONS; i++) {
+        if (CN_ABORTED(i)) return;
+
         __m128i cx;
         if (VARIANT == xmrig::VARIANT_TUBE || !SOFT_AES) {
             cx = _mm_load_si128((__m128i *) &l0[idx0 & MASK]);
@@ -562,6 +564,8 @@ inline void cryptonight_double_hash(const uint8_t *__restrict__ input, size_t si
     uint64_t idx1 = h1[0] ^ h1[4];
 
     for (size_t i = 0; i < ITERATIONS; i++) {
+        if (CN_ABORTED(i)) return;
+
         __m128i cx0, cx1;
         if (VARIANT == xmrig::VARIANT_TUBE || !SOFT_AES) {
             cx0 = _mm_load_si128((__m128i *) &l0[idx0 & MASK]);
@@ -454,6 +454,8 @@ inline void cryptonight_single_hash(const uint8_t *__restrict__ input, size_t si
     uint64_t idx0 = al0;
 
     for (size_t i = 0; i < ITERATIONS; i++) {
+        if (CN_ABORTED(i)) return;
+
         __m128i cx;
         if (VARIANT == xmrig::VARIANT_TUBE || !SOFT_AES) {
             cx = _mm_load_si128((__m128i *) &l0[idx0 & MASK]);
@@ -565,6 +567,8 @@ inline void cryptonight_double_hash(const uint8_t *__restrict__ input, size_t si
     uint64_t idx1 = al1;
 
     for (size_t i = 0; i < ITERATIONS; i++) {
+        if (CN_ABORTED(i)) return;
+
         __m128i cx0, cx1;
         if (VARIANT == xmrig::VARIANT_TUBE || !SOFT_AES) {
             cx0 = _mm_load_si128((__m128i *) &l0[idx0 & MASK]);
@@ -803,6 +807,8 @@ inline void cryptonight_triple_hash(const uint8_t *__restrict__ input, size_t si
     idx2 = EXTRACT64(ax2);
 
     for (size_t i = 0; i < ITERATIONS / 2; i++) {
+        if (CN_ABORTED(i)) return;
+
         uint64_t hi, lo;
         __m128i *ptr0, *ptr1, *ptr2;
 
@@ -902,6 +908,8 @@ inline void cryptonight_quad_hash(const uint8_t *__restrict__ input, size_t size
 
     for (size_t i = 0; i < ITERATIONS / 2; i++)
     {
+        if (CN_ABORTED(i)) return;
+
         uint64_t hi, lo;
         __m128i *ptr0, *ptr1, *ptr2, *ptr3;
 
@@ -1016,6 +1024,8 @@ inline void cryptonight_penta_hash(const uint8_t *__restrict__ input, size_t siz
 
     for (size_t i = 0; i < ITERATIONS / 2; i++)
     {
+        if (CN_ABORTED(i)) return;
+
         uint64_t hi, lo;
         __m128i *ptr0, *ptr1, *ptr2, *ptr3, *ptr4;
 